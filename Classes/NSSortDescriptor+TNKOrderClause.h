@@ -0,0 +1,32 @@
+//
+//  NSSortDescriptor+TNKOrderClause.h
+//  Pods
+//
+//  Created by David Beck on 7/22/14.
+//
+//
+
+#import <Foundation/Foundation.h>
+
+@interface NSSortDescriptor (TNKOrderClause)
+
+/** A single term of an ORDER BY clause for an sqlite SELECT query
+ 
+ This method is used internally by TNKData to generate SQL statements. The key of the sort descriptor must be a persistent key.
+ The selector picks the collation:
+ 
+ - `compare:` uses SQLite's default, binary collation.
+ - `caseInsensitiveCompare:` uses `NOCASE`.
+ - `localizedCompare:` and `localizedStandardCompare:` use `LOCALIZED`, which sorts with `localizedStandardCompare:`.
+ - `localizedCaseInsensitiveCompare:` uses `LOCALIZED_NOCASE`, which sorts with `localizedCaseInsensitiveCompare:`.
+ 
+ The localized collations are registered on every connection.
+ 
+ @warning *Warning:* This method throws exceptions any time it encounters a sort descriptor that cannot be converted into SQL,
+ such as one that uses a comparator block.
+ 
+ @return An ORDER BY term generated from the sort descriptor (without the ORDER BY keyword).
+ */
+- (NSString *)sqliteOrderClause;
+
+@end
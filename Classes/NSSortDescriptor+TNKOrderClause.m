@@ -0,0 +1,39 @@
+//
+//  NSSortDescriptor+TNKOrderClause.m
+//  Pods
+//
+//  Created by David Beck on 7/22/14.
+//
+//
+
+#import "NSSortDescriptor+TNKOrderClause.h"
+
+@implementation NSSortDescriptor (TNKOrderClause)
+
+// http://www.sqlite.org/lang_select.html#orderby
+- (NSString *)sqliteOrderClause
+{
+    NSAssert(self.key != nil, @"Unsupported sort descriptor for sqlite (no key): %@", self);
+    
+    NSString *collation = nil;
+    SEL selector = self.selector;
+    if (selector == NULL || selector == @selector(compare:)) {
+        collation = nil;
+    } else if (selector == @selector(caseInsensitiveCompare:)) {
+        collation = @"NOCASE";
+    } else if (selector == @selector(localizedCompare:) || selector == @selector(localizedStandardCompare:)) {
+        collation = @"LOCALIZED";
+    } else if (selector == @selector(localizedCaseInsensitiveCompare:)) {
+        collation = @"LOCALIZED_NOCASE";
+    } else {
+        NSAssert(NO, @"Unsupported sort descriptor for sqlite (unsupported selector): %@", self);
+    }
+    
+    if (collation != nil) {
+        return [NSString stringWithFormat:@"%@ COLLATE %@ %@", self.key, collation, self.ascending ? @"ASC" : @"DESC"];
+    }
+    
+    return [NSString stringWithFormat:@"%@ %@", self.key, self.ascending ? @"ASC" : @"DESC"];
+}
+
+@end
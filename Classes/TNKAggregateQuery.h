@@ -0,0 +1,88 @@
+//
+//  TNKAggregateQuery.h
+//  Pods
+//
+//  Created by David Beck on 7/22/14.
+//
+//
+
+#import <Foundation/Foundation.h>
+
+
+/** A function that summarizes the values of a key
+ */
+typedef NS_ENUM(NSInteger, TNKAggregateFunction) {
+    /** The number of rows. When used with a key, rows where the key is nil aren't counted. */
+    TNKAggregateFunctionCount,
+    /** The sum of the values. */
+    TNKAggregateFunctionSum,
+    /** The average of the values. */
+    TNKAggregateFunctionAverage,
+    /** The smallest value. */
+    TNKAggregateFunctionMinimum,
+    /** The largest value. */
+    TNKAggregateFunctionMaximum,
+};
+
+
+/** A query that counts or summarizes rows in the database, without loading any objects
+ 
+ The aggregates are computed by SQLite, so a count or sum over a large table is a single statement that can use the table's
+ indexes. Like `TNKObjectQuery`, only saved changes are included.
+ */
+@interface TNKAggregateQuery : NSObject
+
+/** Create a new aggregate query
+ 
+ @param objectClass The `TNKObject` subclass to query.
+ @return An instance of `TNKAggregateQuery`.
+ */
+- (instancetype)initWithObjectClass:(Class)objectClass;
+
+/** The class to query.
+ 
+ The value that was passed on initialization.
+ */
+@property (nonatomic, readonly) Class objectClass;
+
+/** The predicate to filter the rows by.
+ 
+ This will be converted to an SQL where clause. Becasue of this, make sure that you do not use unsupported predicates (such as
+ a block based predicate).
+ */
+@property (nonatomic, copy) NSPredicate *predicate;
+
+/** The persistent keys to group the rows by.
+ 
+ Each group gets it's own result, which includes the values of these keys. If this is empty (the default), all of the matching
+ rows are summarized in a single result.
+ */
+@property (nonatomic, copy) NSArray *groupByKeys;
+
+/** Add an aggregate to compute for each result
+ 
+ If no aggregates are added, the query counts the rows, with the result key `count`.
+ 
+ @param function The function to apply.
+ @param key The persistent key to apply the function to. May be nil for `TNKAggregateFunctionCount` to count every row.
+ @param resultKey The key of the aggregate in the result dictionaries.
+ */
+- (void)addAggregateFunction:(TNKAggregateFunction)function forKey:(NSString *)key resultKey:(NSString *)resultKey;
+
+
+/** Execute the query
+ 
+ @return An array of dictionaries, one for each group, with the values of the `groupByKeys` and the aggregates. Values that are
+ NULL in the database are left out.
+ */
+- (NSArray *)run;
+
+/** Execute the query for a single value
+ 
+ A convenience for queries without `groupByKeys`, such as a count.
+ 
+ @return The first aggregate of the first result, or nil if it is NULL.
+ */
+- (id)runScalar;
+
+@end
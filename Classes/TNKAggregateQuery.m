@@ -0,0 +1,162 @@
+//
+//  TNKAggregateQuery.m
+//  Pods
+//
+//  Created by David Beck on 7/22/14.
+//
+//
+
+#import "TNKAggregateQuery.h"
+
+#import "TNKData.h"
+#import "TNKConnection_Private.h"
+#import "TNKObject_Private.h"
+#import "TNKEntityDescription.h"
+
+
+@interface TNKAggregateQuery ()
+{
+    // SQL expressions and result keys of the aggregates, in the order they were added
+    NSMutableArray *_aggregateExpressions;
+    NSMutableArray *_aggregateResultKeys;
+    // the properties that MIN and MAX were applied to, or NSNull, so their values can be converted back
+    NSMutableArray *_aggregateProperties;
+}
+
+@end
+
+@implementation TNKAggregateQuery
+
+- (instancetype)init
+{
+    NSAssert(NO, @"You cannot call init on TNKAggregateQuery without an object class.");
+    return nil;
+}
+
+- (instancetype)initWithObjectClass:(Class)objectClass
+{
+    self = [super init];
+    if (self) {
+        _objectClass = objectClass;
+        
+        _aggregateExpressions = [NSMutableArray new];
+        _aggregateResultKeys = [NSMutableArray new];
+        _aggregateProperties = [NSMutableArray new];
+    }
+    
+    return self;
+}
+
+- (void)addAggregateFunction:(TNKAggregateFunction)function forKey:(NSString *)key resultKey:(NSString *)resultKey
+{
+    TNKPropertyDescription *property = key != nil ? [[self.objectClass entityDescription] propertyForKey:key] : nil;
+    NSAssert(key == nil || property != nil, @"%@ is not a persistent key of %@.", key, NSStringFromClass(self.objectClass));
+    NSAssert(key != nil || function == TNKAggregateFunctionCount, @"Only counts can be made without a key.");
+    
+    NSString *functionName = nil;
+    switch (function) {
+        case TNKAggregateFunctionCount:
+            functionName = @"COUNT";
+            break;
+        case TNKAggregateFunctionSum:
+            // TOTAL is always a float and 0 for no rows, SUM is an integer for integer columns and NULL for no rows
+            functionName = @"SUM";
+            break;
+        case TNKAggregateFunctionAverage:
+            functionName = @"AVG";
+            break;
+        case TNKAggregateFunctionMinimum:
+            functionName = @"MIN";
+            break;
+        case TNKAggregateFunctionMaximum:
+            functionName = @"MAX";
+            break;
+    }
+    
+    [_aggregateExpressions addObject:[NSString stringWithFormat:@"%@(%@)", functionName, property.name ?: @"*"]];
+    [_aggregateResultKeys addObject:[resultKey copy]];
+    
+    BOOL keepsValues = function == TNKAggregateFunctionMinimum || function == TNKAggregateFunctionMaximum;
+    [_aggregateProperties addObject:keepsValues ? property : [NSNull null]];
+}
+
+// values like dates are stored as numbers, so they are converted back to the class of their property
+static id TNKAggregateValueForProperty(id value, TNKPropertyDescription *property)
+{
+    if (value == nil || value == [NSNull null]) {
+        return nil;
+    }
+    
+    if ((id)property != [NSNull null] && [property.valueClass isSubclassOfClass:[NSDate class]] && [value respondsToSelector:@selector(doubleValue)]) {
+        return [property.valueClass dateWithTimeIntervalSince1970:[value doubleValue]];
+    }
+    
+    return value;
+}
+
+- (NSArray *)run
+{
+    TNKEntityDescription *entity = [self.objectClass entityDescription];
+    
+    NSMutableArray *groupProperties = [[NSMutableArray alloc] initWithCapacity:self.groupByKeys.count];
+    for (NSString *key in self.groupByKeys) {
+        TNKPropertyDescription *property = [entity propertyForKey:key];
+        NSAssert(property != nil, @"%@ is not a persistent key of %@.", key, NSStringFromClass(self.objectClass));
+        [groupProperties addObject:property];
+    }
+    
+    NSArray *aggregateExpressions = _aggregateExpressions.count > 0 ? _aggregateExpressions : @[ @"COUNT(*)" ];
+    NSArray *aggregateResultKeys = _aggregateResultKeys.count > 0 ? _aggregateResultKeys : @[ @"count" ];
+    NSArray *aggregateProperties = _aggregateProperties.count > 0 ? _aggregateProperties : @[ [NSNull null] ];
+    
+    NSMutableArray *columns = [[NSMutableArray alloc] initWithArray:[groupProperties valueForKey:@"name"]];
+    [columns addObjectsFromArray:aggregateExpressions];
+    
+    NSMutableString *query = [[NSMutableString alloc] initWithFormat:@"SELECT %@ FROM %@", [columns componentsJoinedByString:@", "], entity.tableName];
+    if (self.predicate != nil) {
+        [query appendFormat:@" WHERE %@", [self.predicate sqliteWhereClause]];
+    }
+    if (groupProperties.count > 0) {
+        [query appendFormat:@" GROUP BY %@", [[groupProperties valueForKey:@"name"] componentsJoinedByString:@", "]];
+    }
+    NSArray *arguments = [self.predicate sqliteWhereClauseArguments] ?: @[];
+    
+    NSMutableArray *results = [NSMutableArray new];
+    [[TNKConnection currentConnection] performRead:^(FMDatabase *db) {
+        FMResultSet *resultSet = [db executeQuery:query withArgumentsInArray:arguments];
+        while ([resultSet next]) {
+            NSMutableDictionary *result = [[NSMutableDictionary alloc] initWithCapacity:columns.count];
+            
+            int column = 0;
+            for (TNKPropertyDescription *property in groupProperties) {
+                id value = TNKAggregateValueForProperty([resultSet objectForColumnIndex:column], property);
+                if (value != nil) {
+                    result[property.name] = value;
+                }
+                column++;
+            }
+            
+            for (NSUInteger index = 0; index < aggregateExpressions.count; index++) {
+                id value = TNKAggregateValueForProperty([resultSet objectForColumnIndex:column], aggregateProperties[index]);
+                if (value != nil) {
+                    result[aggregateResultKeys[index]] = value;
+                }
+                column++;
+            }
+            
+            [results addObject:result];
+        }
+        [resultSet close];
+    }];
+    
+    return results;
+}
+
+- (id)runScalar
+{
+    NSString *resultKey = _aggregateResultKeys.firstObject ?: @"count";
+    
+    return [[self run].firstObject objectForKey:resultKey];
+}
+
+@end
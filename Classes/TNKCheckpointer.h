@@ -0,0 +1,90 @@
+//
+//  TNKCheckpointer.h
+//  Pods
+//
+//  Created by David Beck on 7/22/14.
+//
+//
+
+#import <Foundation/Foundation.h>
+
+@class FMDatabase;
+
+
+/** Checkpoints a WAL database in the background
+ 
+ SQLite normally checkpoints on the connection that commits, so a save that pushes the WAL past it's limit also pays for copying
+ the WAL back into the database. A checkpointer replaces that with it's own connection and queue. It runs a passive checkpoint
+ once a commit leaves more than `checkpointPageCount` pages in the WAL, and again once the connection has been idle for
+ `idleDelay` seconds after a save. Passive checkpoints never wait for readers or the writer, so if readers keep the WAL from being
+ reset and it grows past `truncatePageCount` pages, the checkpointer escalates to a truncating checkpoint, which waits for them
+ and shrinks the WAL file back to nothing.
+ */
+@interface TNKCheckpointer : NSObject
+
+/** Create a checkpointer
+ 
+ @param path The path of a database in WAL mode.
+ @return A new checkpointer, with it's own connection to the database.
+ */
+- (instancetype)initWithPath:(NSString *)path;
+
+/** The number of pages in the WAL after a commit that triggers a passive checkpoint.
+ 
+ Defaults to 1000, SQLite's own auto checkpoint limit.
+ */
+@property (atomic) NSUInteger checkpointPageCount;
+
+/** The number of pages in the WAL that escalates a checkpoint to a truncating checkpoint.
+ 
+ Defaults to 10000.
+ */
+@property (atomic) NSUInteger truncatePageCount;
+
+/** The number of seconds without a save before an idle checkpoint is made.
+ 
+ Defaults to 5 seconds.
+ */
+@property (atomic) NSTimeInterval idleDelay;
+
+/** The number of checkpoints that have completed, including truncating checkpoints.
+ */
+@property (atomic, readonly) NSUInteger checkpointCount;
+
+/** The number of checkpoints that were escalated to truncating checkpoints.
+ */
+@property (atomic, readonly) NSUInteger truncatingCheckpointCount;
+
+/** The number of checkpoints that returned an error, including SQLITE_BUSY and SQLITE_LOCKED.
+ 
+ An escalation to a truncating checkpoint that fails is counted here, even if the passive checkpoint before it completed.
+ */
+@property (atomic, readonly) NSUInteger failedCheckpointCount;
+
+/** The total time spent in completed checkpoints, in seconds.
+ */
+@property (atomic, readonly) NSTimeInterval checkpointDuration;
+
+/** Watch the commits of the writing connection
+ 
+ This replaces the connection's auto checkpointing, so that commits never checkpoint themselves.
+ 
+ @param db The connection that writes to the database.
+ */
+- (void)observeDatabase:(FMDatabase *)db;
+
+/** Schedule an idle checkpoint
+ 
+ Called after each save. If there is another save within `idleDelay` seconds, the checkpoint is pushed back.
+ */
+- (void)scheduleIdleCheckpoint;
+
+/** Checkpoint the database now
+ 
+ The checkpoint is made on the checkpointer's queue, and this waits for it to finish.
+ 
+ @param truncate Use a truncating checkpoint regardless of the size of the WAL.
+ */
+- (void)checkpointAndTruncate:(BOOL)truncate;
+
+@end
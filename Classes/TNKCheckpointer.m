@@ -0,0 +1,167 @@
+//
+//  TNKCheckpointer.m
+//  Pods
+//
+//  Created by David Beck on 7/22/14.
+//
+//
+
+#import "TNKCheckpointer.h"
+
+#import <libkern/OSAtomic.h>
+
+#import "TNKData.h"
+
+
+// truncating checkpoints were added in SQLite 3.8.8, restarting checkpoints wait for readers in the same way, but leave the WAL
+// file at it's current size
+#ifdef SQLITE_CHECKPOINT_TRUNCATE
+#define TNKCheckpointTruncate SQLITE_CHECKPOINT_TRUNCATE
+#else
+#define TNKCheckpointTruncate SQLITE_CHECKPOINT_RESTART
+#endif
+
+
+@interface TNKCheckpointer ()
+{
+    FMDatabase *_database;
+    dispatch_queue_t _queue;
+    
+    volatile int32_t _checkpointPending;
+    volatile int32_t _idleGeneration;
+}
+
+@property (atomic, readwrite) NSUInteger checkpointCount;
+@property (atomic, readwrite) NSUInteger truncatingCheckpointCount;
+@property (atomic, readwrite) NSUInteger failedCheckpointCount;
+@property (atomic, readwrite) NSTimeInterval checkpointDuration;
+
+- (void)_walDidCommitWithPageCount:(int)pageCount;
+
+@end
+
+static int TNKCheckpointerWALHook(void *context, sqlite3 *db, const char *name, int pageCount)
+{
+    [(__bridge TNKCheckpointer *)context _walDidCommitWithPageCount:pageCount];
+    
+    return SQLITE_OK;
+}
+
+
+@implementation TNKCheckpointer
+
+- (instancetype)init
+{
+    NSAssert(NO, @"You cannot call init on TNKCheckpointer without a path.");
+    return nil;
+}
+
+- (instancetype)initWithPath:(NSString *)path
+{
+    self = [super init];
+    if (self) {
+        _checkpointPageCount = 1000;
+        _truncatePageCount = 10000;
+        _idleDelay = 5.0;
+        
+        _queue = dispatch_queue_create("TNKCheckpointer", DISPATCH_QUEUE_SERIAL);
+        dispatch_set_target_queue(_queue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+        
+        // truncating checkpoints wait for readers and the writer
+        _database = [FMDatabase databaseWithPath:path];
+        _database.busyTimeout = 1.0;
+        [_database open];
+    }
+    
+    return self;
+}
+
+- (void)dealloc
+{
+    [_database close];
+}
+
+- (void)observeDatabase:(FMDatabase *)db
+{
+    sqlite3_wal_hook(db.sqliteHandle, TNKCheckpointerWALHook, (__bridge void *)self);
+}
+
+- (void)_walDidCommitWithPageCount:(int)pageCount
+{
+    if (pageCount < 0 || (NSUInteger)pageCount < self.checkpointPageCount) {
+        return;
+    }
+    
+    // commits that happen before the checkpoint starts don't need one of their own
+    if (OSAtomicCompareAndSwap32Barrier(0, 1, &_checkpointPending)) {
+        dispatch_async(_queue, ^{
+            OSAtomicCompareAndSwap32Barrier(1, 0, &_checkpointPending);
+            [self _checkpointAndTruncate:NO];
+        });
+    }
+}
+
+- (void)scheduleIdleCheckpoint
+{
+    int32_t generation = OSAtomicIncrement32Barrier(&_idleGeneration);
+    
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(self.idleDelay * NSEC_PER_SEC)), _queue, ^{
+        if (generation == _idleGeneration) {
+            [self _checkpointAndTruncate:NO];
+        }
+    });
+}
+
+- (void)checkpointAndTruncate:(BOOL)truncate
+{
+    dispatch_sync(_queue, ^{
+        [self _checkpointAndTruncate:truncate];
+    });
+}
+
+// must be called on _queue
+- (void)_checkpointAndTruncate:(BOOL)truncate
+{
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    
+    int logFrameCount = 0;
+    int checkpointedFrameCount = 0;
+    BOOL checkpointed = NO;
+    if (!truncate) {
+        int result = sqlite3_wal_checkpoint_v2(_database.sqliteHandle, NULL, SQLITE_CHECKPOINT_PASSIVE, &logFrameCount, &checkpointedFrameCount);
+        checkpointed = [self _checkpointDidFinishWithResult:result];
+    }
+    
+    // readers that started before the last checkpoint keep the WAL from being reset, so it keeps growing until we wait for them
+    BOOL truncated = NO;
+    if (truncate || (checkpointed && logFrameCount > 0 && (NSUInteger)logFrameCount >= self.truncatePageCount)) {
+        int result = sqlite3_wal_checkpoint_v2(_database.sqliteHandle, NULL, TNKCheckpointTruncate, &logFrameCount, &checkpointedFrameCount);
+        truncated = [self _checkpointDidFinishWithResult:result];
+    }
+    
+    // a busy or failed checkpoint didn't move anything out of the WAL
+    if (!checkpointed && !truncated) {
+        return;
+    }
+    
+    self.checkpointCount++;
+    if (truncated) {
+        self.truncatingCheckpointCount++;
+    }
+    self.checkpointDuration += CFAbsoluteTimeGetCurrent() - start;
+}
+
+// must be called on _queue
+- (BOOL)_checkpointDidFinishWithResult:(int)result
+{
+    if (result == SQLITE_OK) {
+        return YES;
+    }
+    
+    NSLog(@"Warning, checkpoint failed: result=%d, message=%s", result, sqlite3_errmsg(_database.sqliteHandle));
+    self.failedCheckpointCount++;
+    
+    return NO;
+}
+
+@end
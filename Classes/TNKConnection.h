@@ -8,6 +8,66 @@
 
 #import <Foundation/Foundation.h>
 
+@class TNKSaveScheduler;
+
+
+/** @name Connection Options
+ */
+
+/** The journal mode of a file database, as a string such as `@"WAL"` or `@"DELETE"`.
+ 
+ WAL by default. Queries only use a separate pool of connections, and the database is only checkpointed in the background, in WAL
+ mode.
+ */
+extern NSString *const TNKConnectionJournalModeOption;
+
+/** The synchronous level of a file database, as a string such as `@"FULL"` or `@"NORMAL"`.
+ 
+ SQLite's default (FULL) is used if this isn't set.
+ */
+extern NSString *const TNKConnectionSynchronousOption;
+
+/** The number of pages in the WAL after a save that triggers a background checkpoint, as an NSNumber.
+ 
+ 1000 by default.
+ */
+extern NSString *const TNKConnectionCheckpointPageCountOption;
+
+/** The number of pages in the WAL that escalates a background checkpoint to a truncating checkpoint, as an NSNumber.
+ 
+ Truncating checkpoints wait for queries and saves to finish, but reset the WAL when readers would otherwise keep it growing.
+ 10000 by default.
+ */
+extern NSString *const TNKConnectionTruncatePageCountOption;
+
+/** The number of seconds after the last save to make a background checkpoint, as an NSNumber.
+ 
+ 5 seconds by default.
+ */
+extern NSString *const TNKConnectionIdleCheckpointDelayOption;
+
+/** Whether an iOS connection saves when the app resigns active or enters the background, as an NSNumber.
+ 
+ YES by default. Turn this off for connections used by extensions or background processes, or to handle the app's lifecycle
+ yourself by calling `triggerSave`. This is ignored on OS X.
+ */
+extern NSString *const TNKConnectionObservesApplicationOption;
+
+
+/** How much a save waits for it's changes to reach the disk
+ */
+typedef NS_ENUM(NSInteger, TNKSaveDurability) {
+    /** The save is synced to disk before it returns. */
+    TNKSaveDurabilityFull,
+    /** The save is committed without syncing, and is synced along with other saves by the next background checkpoint or full
+     save. A crash of the app won't lose the save, but a power loss might. In journal modes other than WAL, this still syncs most
+     commits. */
+    TNKSaveDurabilityGroupCommit,
+    /** The save is never explicitly synced. Meant for bulk imports that can be started over. */
+    TNKSaveDurabilityRelaxed,
+};
+
+
 @interface TNKConnection : NSObject
 
 /** The objects waiting to be inserted into the database
@@ -28,6 +88,18 @@
  */
 @property (strong, readonly) NSSet *deletedObjects;
 
+/** The number of inserts, updates and deletes waiting to be saved
+ 
+ Unlike the sets of objects, this is kept as a running count, so it is cheap to check after every change.
+ */
+@property (readonly) NSUInteger pendingChangeCount;
+
+/** A rough estimate of the size of the changes waiting to be saved, in bytes
+ 
+ Each pending change counts as the `estimatedRowSize` of it's entity.
+ */
+@property (readonly) NSUInteger estimatedPendingBytes;
+
 /** Returns a registered object for a given class and primary key
  
  When an object is in memory, it is registered with it is connection. This method will return the object if it is in memory. If
@@ -100,7 +172,8 @@
  created. The classes act as a model for the database. All the tables needed for the database will be created when the connection
  is created. Any updates to the database (new tables and or columns) will be done here as well.
  
- This is the designated initializer for this class.
+ File databases are opened in WAL mode. Queries run on a small pool of read only connections, so they don't wait for a save to
+ finish. A nil URL creates an in memory database, which is read and written on a single connection.
  
  @param URL The file URL of the underlying database.
  @param classes All the `TNKObject` subclasses that will be used in the connection.
@@ -108,11 +181,56 @@
  */
 - (instancetype)initWithURL:(NSURL *)URL classes:(NSSet *)classes;
 
+/** Create a new connection with options
+ 
+ Creates and returns a new connection with an SQLite database at the given URL. If the database does not exist, it will be
+ created. The classes act as a model for the database. All the tables needed for the database will be created when the connection
+ is created. Any updates to the database (new tables and or columns) will be done here as well.
+ 
+ @param URL The file URL of the underlying database.
+ @param classes All the `TNKObject` subclasses that will be used in the connection.
+ @param options A dictionary of connection options, such as `TNKConnectionJournalModeOption`. Options are ignored for in memory
+ databases.
+ @return A new connection.
+ */
++ (instancetype)connectionWithURL:(NSURL *)URL classes:(NSSet *)classes options:(NSDictionary *)options;
+
+/** Create a new connection with options
+ 
+ Creates and returns a new connection with an SQLite database at the given URL. If the database does not exist, it will be
+ created. The classes act as a model for the database. All the tables needed for the database will be created when the connection
+ is created. Any updates to the database (new tables and or columns) will be done here as well.
+ 
+ This is the designated initializer for this class.
+ 
+ @param URL The file URL of the underlying database.
+ @param classes All the `TNKObject` subclasses that will be used in the connection.
+ @param options A dictionary of connection options, such as `TNKConnectionJournalModeOption`. Options are ignored for in memory
+ databases.
+ @return A new connection.
+ */
+- (instancetype)initWithURL:(NSURL *)URL classes:(NSSet *)classes options:(NSDictionary *)options;
+
+
+/** Run several queries against a single state of the database
+ 
+ Every query and `find:` in the block reads from the same read only connection, inside one read transaction. Saves that finish
+ while the block runs are not seen by it, and the block doesn't keep them from being written. The connection is used as the
+ current connection in the block.
+ 
+ If the snapshot can't be started, the block is still run, but each query reads the latest state of the database on it's own.
+ 
+ @warning *Note:* snapshots need a pool of readers, which only file databases in WAL mode have. Calling this on an in memory or
+ non WAL connection is an assertion failure.
+ 
+ @param block A block that queries the connection. It is called on the current thread before this method returns.
+ */
+- (void)performReadSnapshot:(void(^)(TNKConnection *connection))block;
 
 /** Mark the connection as needing to be saved
  
- This will schedule a save `saveInterval` seconds from now. If the connection is saved manually before then, it will not save
- again.
+ This tells the `saveScheduler` about the change, which will normally save it `saveInterval` seconds from now. If the connection
+ is saved manually before then, it will not save again.
 
  You shouldn't need to call this yourself. When you edit, insert or delete objects this is called automatically.
  */
@@ -120,10 +238,11 @@
 
 /** Trigger a save that was queued with `setNeedsSave`
  
- If the connection has already been saved, this is ignored. The save will be triggered on a background queue and this method 
- returns immediately.
+ If the connection has already been saved, this is ignored. The save will be triggered on the `saveScheduler`'s queue and this
+ method returns immediately.
  
- This is automatically called when an iOS app enters the background.
+ On iOS, a save is automatically triggered when the app resigns active or enters the background, unless the connection was
+ created with `TNKConnectionObservesApplicationOption` turned off.
  */
 - (void)triggerSave;
 
@@ -131,9 +250,54 @@
  
  While changes are queued for saving automatically, you may wish to manually save the database. This method blocks until the save
  finishes. You may call it on a background thread if you like.
+ 
+ This is the same as calling `saveWithDurability:` with `TNKSaveDurabilityFull`.
  */
 - (void)save;
 
+/** Manually save the database with a specific durability
+ 
+ The durability only applies to this save. Other saves on the same connection can use a different durability.
+ 
+ @param durability How much the save should wait for it's changes to reach the disk.
+ */
+- (void)saveWithDurability:(TNKSaveDurability)durability;
+
+/** Manually save the database, and find out which changes failed
+ 
+ Changes are saved in chunks limited by `maximumChangesPerTransaction` and `maximumTransactionDuration`. Each chunk is saved in
+ it's own transaction, so if a chunk fails it is rolled back on it's own, and it's changes are kept to be retried by the next
+ save. A save with a failed chunk schedules an automatic save to retry it, after a delay that doubles with each failed save in a
+ row, up to a minute.
+ 
+ @param durability How much the save should wait for it's changes to reach the disk.
+ @param chunkHandler Called on the current thread once for each chunk, in order, with the objects that were in it and the error if
+ it was rolled back. It is called after every chunk has been saved and the save has finished, so it can save the connection or
+ run bulk updates and deletes. May be nil.
+ @return YES if every chunk was saved.
+ */
+- (BOOL)saveWithDurability:(TNKSaveDurability)durability chunkHandler:(void(^)(NSSet *objects, NSError *error))chunkHandler;
+
+/** The most inserts, updates and deletes a save commits in one transaction
+ 
+ A save with more changes than this is split into several transactions. Between them, the database is released so that queries
+ waiting for it can run. This applies to every save, including automatic saves. 0, the default, means there is no limit.
+ */
+@property (atomic) NSUInteger maximumChangesPerTransaction;
+
+/** The longest a save should hold the database in one transaction, in seconds
+ 
+ Chunks are sized from how long the previous chunks of the same save took, so this is a target rather than a hard limit. 0, the
+ default, means there is no limit.
+ */
+@property (atomic) NSTimeInterval maximumTransactionDuration;
+
+/** The durability of automatic saves
+ 
+ `TNKSaveDurabilityGroupCommit` by default, so that frequent automatic saves share a single sync.
+ */
+@property (nonatomic) TNKSaveDurability autosaveDurability;
+
 /** The interval to wait before making automatic saves
  
  When an object is modified, it is automatically saved after a certain time (and all other changes in that time are grouped
@@ -141,7 +305,41 @@
  changes can't be grouped together, however longer times means more data will be lost if the app crashes.
  
  You can also call `save` or `triggerSave` manually to ensure changes are saved immediately.
+ 
+ This is the `interval` of the `saveScheduler`.
  */
 @property (nonatomic) NSTimeInterval saveInterval;
 
+/** Decides when automatic saves are made
+ 
+ Automatic saves are timed on the scheduler's own queue, so they don't depend on the main thread, a run loop or UIKit. You can
+ replace the scheduler with a subclass of `TNKSaveScheduler` to change when saves happen.
+ */
+@property (strong) TNKSaveScheduler *saveScheduler;
+
+
+/** The number of background checkpoints that have been made
+ 
+ File databases in WAL mode are checkpointed on a background queue instead of when a save commits. Checkpoints are made when a
+ save leaves the WAL larger than `TNKConnectionCheckpointPageCountOption` and when the connection is idle after a save. Only
+ checkpoints that completed are counted.
+ */
+@property (readonly) NSUInteger checkpointCount;
+
+/** The number of background checkpoints that were escalated to truncating checkpoints
+ 
+ See `TNKConnectionTruncatePageCountOption`.
+ */
+@property (readonly) NSUInteger truncatingCheckpointCount;
+
+/** The number of background checkpoints that failed
+ 
+ A checkpoint fails if the database is still busy after waiting, or if SQLite returns an error.
+ */
+@property (readonly) NSUInteger failedCheckpointCount;
+
+/** The total time spent in completed background checkpoints, in seconds
+ */
+@property (readonly) NSTimeInterval checkpointDuration;
+
 @end
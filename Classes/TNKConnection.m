@@ -8,12 +8,53 @@
 
 #import "TNKConnection.h"
 
+#import <pthread.h>
+#import <libkern/OSAtomic.h>
+#import <FMDB/FMDatabasePool.h>
+
 #import "TNKData.h"
 #import "TNKConnection_Private.h"
+#import "TNKObject_Private.h"
+#import "TNKEntityDescription.h"
+#import "TNKIdentityMap.h"
+#import "TNKCheckpointer.h"
+#import "TNKSaveScheduler.h"
+#if TARGET_OS_IPHONE
+#import "TNKApplicationSaveObserver.h"
+#endif
 
 
 #define TNKCurrentConnectionThreadKey @"TNKCurrentConnection"
-#define TNKInPropertyQueueThreadKey @"TNKInPropertyQueue"
+
+NSString *const TNKConnectionJournalModeOption = @"TNKConnectionJournalMode";
+NSString *const TNKConnectionSynchronousOption = @"TNKConnectionSynchronous";
+NSString *const TNKConnectionCheckpointPageCountOption = @"TNKConnectionCheckpointPageCount";
+NSString *const TNKConnectionTruncatePageCountOption = @"TNKConnectionTruncatePageCount";
+NSString *const TNKConnectionIdleCheckpointDelayOption = @"TNKConnectionIdleCheckpointDelay";
+NSString *const TNKConnectionObservesApplicationOption = @"TNKConnectionObservesApplication";
+
+// pending changes are split into shards by the object's address, so that threads changing different objects don't wait on
+// each other
+#define TNKChangeShardCount 16
+
+// the number of read only connections that can be open at once
+#define TNKMaximumReaderCount 4
+
+// the size of the first chunk of a save that is only limited by duration
+#define TNKInitialSaveChunkSize 1000
+
+// a save that fails is retried after TNKSaveRetryDelay seconds, doubling with each failure in a row up to TNKMaximumSaveRetryDelay
+#define TNKSaveRetryDelay 1.0
+#define TNKMaximumSaveRetryDelay 60.0
+
+// how long a connection waits for a lock held by another connection, such as a checkpoint that is waiting for readers
+#define TNKBusyTimeout 5.0
+
+NS_INLINE NSUInteger TNKChangeShardForObject(TNKObject *object)
+{
+    uintptr_t address = (uintptr_t)(__bridge void *)object;
+    return ((address >> 4) ^ (address >> 12)) % TNKChangeShardCount;
+}
 
 
 // http://www.blackdogfoundry.com/blog/supporting-regular-expressions-in-sqlite/
@@ -75,21 +116,107 @@ static void TNKSQLiteLike(sqlite3_context *context, int argc, sqlite3_value **ar
 	sqlite3_result_int(context, (int)matches);
 }
 
+// collations for sort descriptors that use localizedStandardCompare: or localizedCaseInsensitiveCompare:
+static int TNKSQLiteLocalizedCollation(void *context, int length1, const void *bytes1, int length2, const void *bytes2)
+{
+    NSString *string1 = [[NSString alloc] initWithBytesNoCopy:(void *)bytes1 length:length1 encoding:NSUTF8StringEncoding freeWhenDone:NO] ?: @"";
+    NSString *string2 = [[NSString alloc] initWithBytesNoCopy:(void *)bytes2 length:length2 encoding:NSUTF8StringEncoding freeWhenDone:NO] ?: @"";
+    
+    if (context != NULL) {
+        return (int)[string1 localizedCaseInsensitiveCompare:string2];
+    }
+    
+    return (int)[string1 localizedStandardCompare:string2];
+}
+
+static void TNKRegisterFunctions(FMDatabase *db)
+{
+    sqlite3_create_function_v2(db.sqliteHandle, "REGEXP", 2, SQLITE_ANY, 0, TNKSQLiteRegexp, NULL, NULL, NULL);
+    sqlite3_create_function_v2(db.sqliteHandle, "PREDICATE_LIKE", 3, SQLITE_ANY, 0, TNKSQLiteLike, NULL, NULL, NULL);
+    sqlite3_create_collation_v2(db.sqliteHandle, "LOCALIZED", SQLITE_UTF8, NULL, TNKSQLiteLocalizedCollation, NULL);
+    // any non NULL context marks the case insensitive version
+    sqlite3_create_collation_v2(db.sqliteHandle, "LOCALIZED_NOCASE", SQLITE_UTF8, (void *)1, TNKSQLiteLocalizedCollation, NULL);
+}
+
+
+// Hands out objectIDs for a single class. The allocator is seeded with the largest objectID in the table when the connection is
+// opened, and checked again by each save, since other connections to the same file allocate from the same ids.
+@interface TNKObjectIDAllocator : NSObject
+{
+    volatile int64_t _lastObjectID;
+}
+
+- (instancetype)initWithLastObjectID:(int64_t)lastObjectID;
+- (NSUInteger)nextObjectID;
+- (void)reserveObjectID:(NSUInteger)objectID;
+
+@end
+
+@implementation TNKObjectIDAllocator
+
+- (instancetype)initWithLastObjectID:(int64_t)lastObjectID
+{
+    self = [super init];
+    if (self) {
+        _lastObjectID = lastObjectID;
+    }
+    
+    return self;
+}
+
+- (NSUInteger)nextObjectID
+{
+    return (NSUInteger)OSAtomicIncrement64Barrier(&_lastObjectID);
+}
+
+- (void)reserveObjectID:(NSUInteger)objectID
+{
+    // an object was given it's own id (for instance from a server), so we can't hand that one out later
+    int64_t lastObjectID;
+    do {
+        lastObjectID = _lastObjectID;
+        if ((int64_t)objectID <= lastObjectID) {
+            return;
+        }
+    } while (!OSAtomicCompareAndSwap64Barrier(lastObjectID, (int64_t)objectID, &_lastObjectID));
+}
+
+@end
+
 
 @interface TNKConnection ()
 {
     NSSet *_classes;
+    NSMapTable *_objectIDAllocators;
+    
+    NSMapTable *_identityMaps;
+    
+    // each an array of TNKChangeShardCount sets, guarded by the lock with the same index
+    NSArray *_insertedObjects;
+    NSArray *_updatedObjects;
+    NSArray *_deletedObjects;
+    pthread_mutex_t _changeLocks[TNKChangeShardCount];
     
-    NSMapTable *_registeredObjects;
-    NSMutableSet *_insertedObjects;
-    NSMutableSet *_updatedObjects;
-    NSMutableSet *_deletedObjects;
+    volatile int32_t _needsSave;
+    // saves are made one at a time, so that an object's changes are only ever set aside by one save
+    pthread_mutex_t _saveLock;
+    volatile int64_t _pendingChangeCount;
+    volatile int64_t _estimatedPendingBytes;
+    // saves in a row that had a chunk fail, used to back off retries
+    volatile int32_t _failedSaveCount;
     
-    BOOL _needsSave;
+    // only used for file databases in WAL mode, each in memory connection would be it's own database
+    FMDatabasePool *_readerPool;
+    dispatch_semaphore_t _readerSemaphore;
     
-    dispatch_queue_t _propertyQueue;
-#ifdef TARGET_OS_IPHONE
-    UIBackgroundTaskIdentifier _saveTask;
+    // the thread dictionary key for the database pinned by performReadSnapshot:, unique to each connection
+    NSString *_readSnapshotThreadKey;
+    
+    TNKCheckpointer *_checkpointer;
+    // the synchronous level the database was opened with, restored after each save
+    int _defaultSynchronous;
+#if TARGET_OS_IPHONE
+    TNKApplicationSaveObserver *_applicationObserver;
 #endif
 }
 
@@ -100,37 +227,32 @@ static void TNKSQLiteLike(sqlite3_context *context, int argc, sqlite3_value **ar
 
 - (NSSet *)insertedObjects
 {
-    __block NSSet *insertedObjects = nil;
-    [self performBlockAndWait:^{
-        insertedObjects = [_insertedObjects copy];
-    }];
-    
-    return insertedObjects;
+    return [self _objectsInShards:_insertedObjects];
 }
 
 - (NSSet *)updatedObjects
 {
-    __block NSSet *updatedObjects = nil;
-    [self performBlockAndWait:^{
-        updatedObjects = [_updatedObjects copy];
-    }];
-    
-    return updatedObjects;
+    return [self _objectsInShards:_updatedObjects];
 }
 
 - (NSSet *)deletedObjects
 {
-    __block NSSet *deletedObjects = nil;
-    [self performBlockAndWait:^{
-        deletedObjects = [_deletedObjects copy];
-    }];
-    
-    return deletedObjects;
+    return [self _objectsInShards:_deletedObjects];
+}
+
+- (NSUInteger)pendingChangeCount
+{
+    return (NSUInteger)MAX(_pendingChangeCount, 0);
+}
+
+- (NSUInteger)estimatedPendingBytes
+{
+    return (NSUInteger)MAX(_estimatedPendingBytes, 0);
 }
 
 - (id)existingObjectWithClass:(Class)objectClass primaryValues:(NSDictionary *)primaryValues
 {
-    return [_registeredObjects objectForKey:[self.class _keyForObjectClass:objectClass primaryValues:primaryValues]];
+    return [[self identityMapForClass:objectClass] objectForPrimaryValues:primaryValues];
 }
 
 
@@ -155,16 +277,20 @@ static TNKConnection *_defaultConnection = nil;
 
 + (void)useConnection:(TNKConnection *)connection block:(void(^)(TNKConnection *connection))block
 {
-    TNKConnection *oldConnection = [NSThread currentThread].threadDictionary[TNKCurrentConnectionThreadKey];
+    NSMutableDictionary *threadDictionary = [NSThread currentThread].threadDictionary;
+    TNKConnection *oldConnection = threadDictionary[TNKCurrentConnectionThreadKey];
     
-    [NSThread currentThread].threadDictionary[TNKCurrentConnectionThreadKey] = connection;
+    threadDictionary[TNKCurrentConnectionThreadKey] = connection;
     
     if (block) {
         block(connection);
     }
     
+    // GCD reuses it's threads, so a connection left behind would become the current connection of unrelated work
     if (oldConnection != nil) {
-        [NSThread currentThread].threadDictionary[TNKCurrentConnectionThreadKey] = oldConnection;
+        threadDictionary[TNKCurrentConnectionThreadKey] = oldConnection;
+    } else {
+        [threadDictionary removeObjectForKey:TNKCurrentConnectionThreadKey];
     }
 }
 
@@ -176,212 +302,728 @@ static TNKConnection *_defaultConnection = nil;
     return [[self alloc] initWithURL:URL classes:classes];
 }
 
++ (instancetype)connectionWithURL:(NSURL *)URL classes:(NSSet *)classes options:(NSDictionary *)options
+{
+    return [[self alloc] initWithURL:URL classes:classes options:options];
+}
+
 - (instancetype)init
 {
     return [self initWithURL:nil classes:nil];
 }
 
 - (instancetype)initWithURL:(NSURL *)URL classes:(NSSet *)classes
+{
+    return [self initWithURL:URL classes:classes options:nil];
+}
+
+- (instancetype)initWithURL:(NSURL *)URL classes:(NSSet *)classes options:(NSDictionary *)options
 {
     NSAssert(URL.isFileURL || URL == nil, @"URL must be a file URL.");
     
     self = [super init];
     if (self) {
-        _registeredObjects = [[NSMapTable alloc] initWithKeyOptions:NSMapTableCopyIn valueOptions:NSMapTableWeakMemory capacity:0];
-        _insertedObjects = [NSMutableSet new];
-        _updatedObjects = [NSMutableSet new];
-        _deletedObjects = [NSMutableSet new];
+        _identityMaps = [NSMapTable strongToStrongObjectsMapTable];
         
-        _propertyQueue = dispatch_queue_create("TNKConnection-property-accessor", NULL);
-        _saveInterval = 1.0;
+        NSMutableArray *insertedObjects = [[NSMutableArray alloc] initWithCapacity:TNKChangeShardCount];
+        NSMutableArray *updatedObjects = [[NSMutableArray alloc] initWithCapacity:TNKChangeShardCount];
+        NSMutableArray *deletedObjects = [[NSMutableArray alloc] initWithCapacity:TNKChangeShardCount];
+        for (NSUInteger shard = 0; shard < TNKChangeShardCount; shard++) {
+            [insertedObjects addObject:[NSMutableSet new]];
+            [updatedObjects addObject:[NSMutableSet new]];
+            [deletedObjects addObject:[NSMutableSet new]];
+            pthread_mutex_init(&_changeLocks[shard], NULL);
+        }
+        pthread_mutex_init(&_saveLock, NULL);
+        _insertedObjects = [insertedObjects copy];
+        _updatedObjects = [updatedObjects copy];
+        _deletedObjects = [deletedObjects copy];
+        
+        _saveScheduler = [[TNKSaveScheduler alloc] initWithConnection:self];
+        _autosaveDurability = TNKSaveDurabilityGroupCommit;
+        _readSnapshotThreadKey = [NSString stringWithFormat:@"TNKReadSnapshot-%p", self];
         
         _databaseQueue = [FMDatabaseQueue databaseQueueWithPath:URL.path];
         _classes = [classes copyWithZone:nil];
         
+        // build the metadata and accessors for each class up front, so that it isn't done while objects are being used
+        for (Class class in _classes) {
+            [class entityDescription];
+            [class installPersistentAccessors];
+            [self identityMapForClass:class];
+        }
+        
+        if (URL != nil) {
+            [self _configureDatabaseAtPath:URL.path options:options];
+        }
+        
         [_databaseQueue inTransaction:^(FMDatabase *db, BOOL *rollback) {
-            sqlite3_create_function_v2(db.sqliteHandle, "REGEXP", 2, SQLITE_ANY, 0, TNKSQLiteRegexp, NULL, NULL, NULL);
-            sqlite3_create_function_v2(db.sqliteHandle, "PREDICATE_LIKE", 3, SQLITE_ANY, 0, TNKSQLiteLike, NULL, NULL, NULL);
+            TNKRegisterFunctions(db);
             
             for (Class class in _classes) {
                 [class createTableInDatabase:db];
             }
+            
+            _objectIDAllocators = [self.class _objectIDAllocatorsForClasses:_classes inDatabase:db];
+            
+            FMResultSet *result = [db executeQuery:@"PRAGMA synchronous"];
+            _defaultSynchronous = [result next] ? [result intForColumnIndex:0] : 2;
+            [result close];
         }];
         
-        
-#ifdef TARGET_OS_IPHONE
-        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(applicationWillResignActive:) name:UIApplicationWillResignActiveNotification object:nil];
-#else
+#if TARGET_OS_IPHONE
+        if (options[TNKConnectionObservesApplicationOption] == nil || [options[TNKConnectionObservesApplicationOption] boolValue]) {
+            _applicationObserver = [[TNKApplicationSaveObserver alloc] initWithConnection:self];
+        }
 #endif
     }
     
     return self;
 }
 
+- (void)_configureDatabaseAtPath:(NSString *)path options:(NSDictionary *)options
+{
+    NSString *journalMode = options[TNKConnectionJournalModeOption] ?: @"WAL";
+    NSString *synchronous = options[TNKConnectionSynchronousOption];
+    
+    __block BOOL usesWAL = NO;
+    [_databaseQueue inDatabase:^(FMDatabase *db) {
+        // truncating checkpoints hold the write lock while they wait for readers, so a save has to wait for them too
+        db.busyTimeout = TNKBusyTimeout;
+        
+        // the journal mode pragma returns the mode the database ended up in, which may not be the one we asked for
+        FMResultSet *result = [db executeQuery:[NSString stringWithFormat:@"PRAGMA journal_mode = %@", journalMode]];
+        if ([result next]) {
+            usesWAL = [[result stringForColumnIndex:0] caseInsensitiveCompare:@"WAL"] == NSOrderedSame;
+        }
+        [result close];
+        
+        if (synchronous != nil) {
+            [db executeUpdate:[NSString stringWithFormat:@"PRAGMA synchronous = %@", synchronous]];
+        }
+    }];
+    
+    if (!usesWAL) {
+        return;
+    }
+    
+    // in WAL mode readers see the last commit instead of waiting for the writer
+    _readerPool = [[FMDatabasePool alloc] initWithPath:path flags:SQLITE_OPEN_READONLY];
+    _readerPool.delegate = self;
+    _readerPool.maximumNumberOfDatabasesToCreate = TNKMaximumReaderCount;
+    _readerSemaphore = dispatch_semaphore_create(TNKMaximumReaderCount);
+    
+    _checkpointer = [[TNKCheckpointer alloc] initWithPath:path];
+    if (options[TNKConnectionCheckpointPageCountOption] != nil) {
+        _checkpointer.checkpointPageCount = [options[TNKConnectionCheckpointPageCountOption] unsignedIntegerValue];
+    }
+    if (options[TNKConnectionTruncatePageCountOption] != nil) {
+        _checkpointer.truncatePageCount = [options[TNKConnectionTruncatePageCountOption] unsignedIntegerValue];
+    }
+    if (options[TNKConnectionIdleCheckpointDelayOption] != nil) {
+        _checkpointer.idleDelay = [options[TNKConnectionIdleCheckpointDelayOption] doubleValue];
+    }
+    
+    [_databaseQueue inDatabase:^(FMDatabase *db) {
+        [_checkpointer observeDatabase:db];
+    }];
+}
+
+- (void)dealloc
+{
+    for (NSUInteger shard = 0; shard < TNKChangeShardCount; shard++) {
+        pthread_mutex_destroy(&_changeLocks[shard]);
+    }
+    pthread_mutex_destroy(&_saveLock);
+}
+
 
 #pragma mark - Objects Management
 
-+ (NSString *)_keyForObject:(TNKObject *)object
++ (NSMapTable *)_objectIDAllocatorsForClasses:(NSSet *)classes inDatabase:(FMDatabase *)db
 {
-    NSMutableDictionary *primaryKeys = [NSMutableDictionary new];
-    for (NSString *key in [[[object.class primaryKeys] allObjects] sortedArrayUsingSelector:@selector(compare:)]) {
-        primaryKeys[key] = [object valueForKey:key];
+    NSMapTable *objectIDAllocators = [NSMapTable strongToStrongObjectsMapTable];
+    for (Class class in classes) {
+        TNKEntityDescription *entity = [class entityDescription];
+        TNKPropertyDescription *objectIDProperty = [entity propertyForKey:@"objectID"];
+        if (objectIDProperty == nil || objectIDProperty.storage == TNKPropertyStorageObject) {
+            continue;
+        }
+        
+        FMResultSet *result = [db executeQuery:[NSString stringWithFormat:@"SELECT MAX(objectID) FROM %@", entity.tableName]];
+        int64_t lastObjectID = [result next] ? [result longLongIntForColumnIndex:0] : 0;
+        [result close];
+        
+        [objectIDAllocators setObject:[[TNKObjectIDAllocator alloc] initWithLastObjectID:lastObjectID] forKey:class];
     }
     
-    return [self _keyForObjectClass:object.class primaryValues:primaryKeys];
+    return objectIDAllocators;
 }
 
-+ (NSString *)_keyForObjectClass:(Class)objectClass primaryValues:(NSDictionary *)primaryValues
+- (void)_allocateObjectIDForObject:(TNKObject *)object
 {
-    NSMutableString *keyForObject = [NSMutableString stringWithString:[objectClass sqliteTableName]];
+    // the allocators are only created during init, so they can be read from any thread
+    TNKObjectIDAllocator *allocator = [_objectIDAllocators objectForKey:object.class];
+    if (allocator == nil) {
+        return;
+    }
     
-    [primaryValues enumerateKeysAndObjectsUsingBlock:^(id key, id obj, BOOL *stop) {
-        [keyForObject appendFormat:@",%@=%@", key, obj];
-    }];
+    NSUInteger objectID = object.objectID;
+    if (objectID == 0) {
+        object.objectID = [allocator nextObjectID];
+        [object addState:TNKObjectStateAllocatedObjectID];
+    } else {
+        [allocator reserveObjectID:objectID];
+    }
+}
+
+- (TNKIdentityMap *)identityMapForClass:(Class)objectClass
+{
+    if (objectClass == Nil) {
+        return nil;
+    }
     
-    return keyForObject;
+    @synchronized(_identityMaps) {
+        TNKIdentityMap *identityMap = [_identityMaps objectForKey:objectClass];
+        if (identityMap == nil) {
+            identityMap = [[TNKIdentityMap alloc] initWithEntity:[objectClass entityDescription]];
+            [_identityMaps setObject:identityMap forKey:objectClass];
+        }
+        
+        return identityMap;
+    }
 }
 
 - (void)registerObject:(TNKObject *)object
 {
-    [self performBlock:^{
-        [_registeredObjects setObject:object forKey:[self.class _keyForObject:object]];
-    }];
+    [[self identityMapForClass:object.class] registerObject:object];
 }
 
 - (void)insertObject:(TNKObject *)object
 {
-    NSString *key = [self.class _keyForObject:object];
-    [self performBlock:^{
-        [_insertedObjects addObject:object];
-        [_registeredObjects setObject:object forKey:key];
-        [self setNeedsSave];
-    }];
+    [object addState:TNKObjectStateInserted];
+    
+    // the id needs to be assigned before the object is registered, so that it can be found by it's id before it is saved
+    [self _allocateObjectIDForObject:object];
+    
+    [self registerObject:object];
+    [self _addObject:object toShards:_insertedObjects];
 }
 
 - (void)updateObject:(TNKObject *)object
 {
-    [self performBlock:^{
-        [_updatedObjects addObject:object];
-        [self setNeedsSave];
-    }];
+    // only queue the object the first time it changes between saves
+    if (![object addState:TNKObjectStateUpdated]) {
+        return;
+    }
+    
+    [self _addObject:object toShards:_updatedObjects];
 }
 
 - (void)deleteObject:(TNKObject *)object
 {
-    [self performBlock:^{
-        [_deletedObjects addObject:object];
-        [self setNeedsSave];
-    }];
+    if (![object addState:TNKObjectStateDeleted]) {
+        return;
+    }
+    
+    [self _addObject:object toShards:_deletedObjects];
+}
+
+- (void)_addObject:(TNKObject *)object toShards:(NSArray *)shards
+{
+    NSUInteger shard = TNKChangeShardForObject(object);
+    
+    pthread_mutex_lock(&_changeLocks[shard]);
+    [shards[shard] addObject:object];
+    pthread_mutex_unlock(&_changeLocks[shard]);
+    
+    // counted before the scheduler is told, so that it sees the change when deciding to save early
+    OSAtomicIncrement64Barrier(&_pendingChangeCount);
+    OSAtomicAdd64Barrier((int64_t)[object.class entityDescription].estimatedRowSize, &_estimatedPendingBytes);
+    
+    [self setNeedsSave];
+}
+
+- (NSSet *)_objectsInShards:(NSArray *)shards
+{
+    NSMutableSet *objects = [NSMutableSet new];
+    for (NSUInteger shard = 0; shard < TNKChangeShardCount; shard++) {
+        pthread_mutex_lock(&_changeLocks[shard]);
+        [objects unionSet:shards[shard]];
+        pthread_mutex_unlock(&_changeLocks[shard]);
+    }
+    
+    return objects;
 }
 
 
-#pragma mark - Concurrency
+#pragma mark - Reading
 
-- (void)performBlock:(void(^)())block
+- (void)performRead:(void(^)(FMDatabase *db))block
 {
-    if ([[NSThread currentThread].threadDictionary[TNKInPropertyQueueThreadKey] boolValue]) {
-        block();
-    } else {
-        dispatch_async(_propertyQueue, ^{
-            [NSThread currentThread].threadDictionary[TNKInPropertyQueueThreadKey] = @YES;
-            block();
-            [[NSThread currentThread].threadDictionary removeObjectForKey:TNKInPropertyQueueThreadKey];
-        });
+    FMDatabase *snapshotDatabase = [NSThread currentThread].threadDictionary[_readSnapshotThreadKey];
+    if (snapshotDatabase != nil) {
+        block(snapshotDatabase);
+        return;
+    }
+    
+    if (_readerPool == nil) {
+        [_databaseQueue inDatabase:block];
+        return;
     }
+    
+    // the pool returns nil instead of waiting when all of it's connections are in use
+    dispatch_semaphore_wait(_readerSemaphore, DISPATCH_TIME_FOREVER);
+    [_readerPool inDatabase:block];
+    dispatch_semaphore_signal(_readerSemaphore);
 }
 
-- (void)performBlockAndWait:(void(^)())block
+- (void)performReadSnapshot:(void(^)(TNKConnection *connection))block
 {
-    if ([[NSThread currentThread].threadDictionary[TNKInPropertyQueueThreadKey] boolValue]) {
-        block();
-    } else {
-        dispatch_sync(_propertyQueue, ^{
-            [NSThread currentThread].threadDictionary[TNKInPropertyQueueThreadKey] = @YES;
-            block();
-            [[NSThread currentThread].threadDictionary removeObjectForKey:TNKInPropertyQueueThreadKey];
-        });
+    NSMutableDictionary *threadDictionary = [NSThread currentThread].threadDictionary;
+    
+    // nested snapshots share the outer one
+    if (threadDictionary[_readSnapshotThreadKey] != nil) {
+        [TNKConnection useConnection:self block:block];
+        return;
     }
+    
+    // without a pool the snapshot would have to hold the writer, and a save in the block would wait on itself
+    NSAssert(_readerPool != nil, @"Read snapshots need a WAL database with a pool of readers.");
+    if (_readerPool == nil) {
+        NSLog(@"Warning, read snapshots need a WAL database, running the block without one.");
+        [TNKConnection useConnection:self block:block];
+        return;
+    }
+    
+    [self performRead:^(FMDatabase *db) {
+        if (![db beginDeferredTransaction]) {
+            NSLog(@"Warning, could not begin a read snapshot: %@", [db lastErrorMessage]);
+            [TNKConnection useConnection:self block:block];
+            return;
+        }
+        
+        // a deferred transaction doesn't take it's snapshot until it first reads
+        FMResultSet *result = [db executeQuery:@"SELECT COUNT(*) FROM sqlite_master"];
+        [result next];
+        [result close];
+        
+        threadDictionary[_readSnapshotThreadKey] = db;
+        [TNKConnection useConnection:self block:block];
+        [threadDictionary removeObjectForKey:_readSnapshotThreadKey];
+        
+        if (![db commit]) {
+            NSLog(@"Warning, could not end a read snapshot: %@", [db lastErrorMessage]);
+        }
+    }];
+}
+
+- (void)databasePool:(FMDatabasePool *)pool didAddDatabase:(FMDatabase *)database
+{
+    database.busyTimeout = TNKBusyTimeout;
+    TNKRegisterFunctions(database);
+}
+
+
+#pragma mark - Checkpoints
+
+- (NSUInteger)checkpointCount
+{
+    return _checkpointer.checkpointCount;
+}
+
+- (NSUInteger)truncatingCheckpointCount
+{
+    return _checkpointer.truncatingCheckpointCount;
+}
+
+- (NSUInteger)failedCheckpointCount
+{
+    return _checkpointer.failedCheckpointCount;
+}
+
+- (NSTimeInterval)checkpointDuration
+{
+    return _checkpointer.checkpointDuration;
+}
+
+- (void)checkpointAndTruncate:(BOOL)truncate
+{
+    [_checkpointer checkpointAndTruncate:truncate];
 }
 
 
 #pragma mark - Saving
 
+- (NSTimeInterval)saveInterval
+{
+    return self.saveScheduler.interval;
+}
+
+- (void)setSaveInterval:(NSTimeInterval)saveInterval
+{
+    self.saveScheduler.interval = saveInterval;
+}
+
 - (void)setNeedsSave
 {
-    [self performBlock:^{
-        if (!_needsSave) {
-            _needsSave = YES;
-            
-            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, self.saveInterval * NSEC_PER_SEC), dispatch_get_main_queue(), ^(void){
-                [self triggerSave];
-            });
-        }
-    }];
+    OSAtomicCompareAndSwap32Barrier(0, 1, &_needsSave);
+    [self.saveScheduler setNeedsSave];
 }
 
 - (void)triggerSave
 {
-    [self performBlock:^{
-        if (_needsSave) {
-            dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-                [self save];
-                
-                if (_saveTask != UIBackgroundTaskInvalid) {
-                    [[UIApplication sharedApplication] endBackgroundTask:_saveTask];
-                }
-            });
-        } else {
-            if (_saveTask != UIBackgroundTaskInvalid) {
-                [[UIApplication sharedApplication] endBackgroundTask:_saveTask];
-            }
-        }
-    }];
+    [self.saveScheduler triggerSaveWithCompletion:nil];
+}
+
+- (void)autosave
+{
+    if (_needsSave) {
+        [self saveWithDurability:self.autosaveDurability];
+    }
 }
 
 - (void)save
 {
-    NSLog(@"saving");
+    [self saveWithDurability:TNKSaveDurabilityFull];
+}
+
+// the value of PRAGMA synchronous for a save
+- (int)_synchronousForDurability:(TNKSaveDurability)durability
+{
+    switch (durability) {
+        case TNKSaveDurabilityFull:
+            // FULL, or EXTRA if the database was opened with it
+            return MAX(_defaultSynchronous, 2);
+        case TNKSaveDurabilityGroupCommit:
+            // NORMAL, in WAL mode the commit isn't synced until the next checkpoint or full save
+            return 1;
+        case TNKSaveDurabilityRelaxed:
+            // OFF
+            return 0;
+    }
+}
+
+// Returns up to *remaining objects starting at *index, and advances both.
+static NSArray *TNKNextChunk(NSArray *objects, NSUInteger *index, NSUInteger *remaining)
+{
+    NSUInteger length = MIN(objects.count - *index, *remaining);
+    NSArray *chunk = [objects subarrayWithRange:NSMakeRange(*index, length)];
+    
+    *index += length;
+    *remaining -= length;
+    
+    return chunk;
+}
+
+- (void)saveWithDurability:(TNKSaveDurability)durability
+{
+    [self saveWithDurability:durability chunkHandler:nil];
+}
+
+- (BOOL)saveWithDurability:(TNKSaveDurability)durability chunkHandler:(void(^)(NSSet *objects, NSError *error))chunkHandler
+{
+    pthread_mutex_lock(&_saveLock);
+    
+    OSAtomicCompareAndSwap32Barrier(1, 0, &_needsSave);
     
-    __block NSSet *insertedObjects = nil;
-    __block NSSet *updatedObjects = nil;
-    __block NSSet *deletedObjects = nil;
-    [self performBlockAndWait:^{
-        _needsSave = NO;
+    NSMutableSet *insertedObjects = [NSMutableSet new];
+    NSMutableSet *updatedObjects = [NSMutableSet new];
+    NSMutableSet *deletedObjects = [NSMutableSet new];
+    for (NSUInteger shard = 0; shard < TNKChangeShardCount; shard++) {
+        pthread_mutex_lock(&_changeLocks[shard]);
         
-        insertedObjects = [_insertedObjects copy];
-        _insertedObjects = [NSMutableSet new];
+        // cleared while the sets are drained, so that a change made during the save marks the object as updated again
+        for (TNKObject *object in _insertedObjects[shard]) {
+            [object removeState:TNKObjectStateInserted];
+        }
+        for (TNKObject *object in _updatedObjects[shard]) {
+            [object removeState:TNKObjectStateUpdated];
+        }
         
-        updatedObjects = [_updatedObjects copy];
-        _updatedObjects = [NSMutableSet new];
+        [insertedObjects unionSet:_insertedObjects[shard]];
+        [_insertedObjects[shard] removeAllObjects];
+        [updatedObjects unionSet:_updatedObjects[shard]];
+        [_updatedObjects[shard] removeAllObjects];
+        [deletedObjects unionSet:_deletedObjects[shard]];
+        [_deletedObjects[shard] removeAllObjects];
         
-        deletedObjects = [_deletedObjects copy];
-        _deletedObjects = [NSMutableSet new];
-    }];
+        pthread_mutex_unlock(&_changeLocks[shard]);
+    }
+    
+    // only the drained changes are subtracted, changes made since then are still pending
+    OSAtomicAdd64Barrier(-(int64_t)(insertedObjects.count + updatedObjects.count + deletedObjects.count), &_pendingChangeCount);
+    OSAtomicAdd64Barrier(-[self.class _estimatedSizeOfObjects:insertedObjects] - [self.class _estimatedSizeOfObjects:updatedObjects] - [self.class _estimatedSizeOfObjects:deletedObjects], &_estimatedPendingBytes);
+    
+    // objects that were inserted and deleted since the last save never need to reach the database, and deleted objects don't need
+    // their changes written first
+    NSMutableSet *cancelledObjects = [insertedObjects mutableCopy];
+    [cancelledObjects intersectSet:deletedObjects];
+    [insertedObjects minusSet:cancelledObjects];
+    [deletedObjects minusSet:cancelledObjects];
+    [updatedObjects minusSet:cancelledObjects];
+    [updatedObjects minusSet:deletedObjects];
+    
+    // outside of the shard locks, since an object holds it's own lock while it queues itself
+    for (TNKObject *object in insertedObjects) {
+        [object beginSavingChanges];
+    }
+    for (TNKObject *object in updatedObjects) {
+        [object beginSavingChanges];
+    }
+    
+    NSArray *inserted = insertedObjects.allObjects;
+    NSArray *updated = updatedObjects.allObjects;
+    NSArray *deleted = deletedObjects.allObjects;
+    NSUInteger insertedIndex = 0;
+    NSUInteger updatedIndex = 0;
+    NSUInteger deletedIndex = 0;
+    
+    NSUInteger maximumChangeCount = self.maximumChangesPerTransaction ?: NSUIntegerMax;
+    NSTimeInterval maximumDuration = self.maximumTransactionDuration;
+    NSUInteger chunkSize = maximumDuration > 0.0 ? MIN(maximumChangeCount, TNKInitialSaveChunkSize) : maximumChangeCount;
+    
+    int synchronous = [self _synchronousForDurability:durability];
+    BOOL success = YES;
+    // the handler is called once the save lock is released, so that it can save or run bulk operations on the connection
+    NSMutableArray *chunkResults = chunkHandler != nil ? [NSMutableArray new] : nil;
+    while (insertedIndex < inserted.count || updatedIndex < updated.count || deletedIndex < deleted.count) {
+        // inserts go first, so that later chunks can update or delete them
+        NSUInteger remaining = chunkSize;
+        NSArray *chunkInserted = TNKNextChunk(inserted, &insertedIndex, &remaining);
+        NSArray *chunkUpdated = TNKNextChunk(updated, &updatedIndex, &remaining);
+        NSArray *chunkDeleted = TNKNextChunk(deleted, &deletedIndex, &remaining);
+        NSUInteger count = chunkSize - remaining;
+        
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        NSError *error = [self _saveChunkWithInsertedObjects:chunkInserted updatedObjects:chunkUpdated deletedObjects:chunkDeleted synchronous:synchronous];
+        NSTimeInterval duration = CFAbsoluteTimeGetCurrent() - start;
+        
+        for (TNKObject *object in chunkInserted) {
+            [object finishSavingChanges:error == nil];
+        }
+        for (TNKObject *object in chunkUpdated) {
+            [object finishSavingChanges:error == nil];
+        }
+        
+        if (error != nil) {
+            success = NO;
+            [self _requeueInsertedObjects:chunkInserted updatedObjects:chunkUpdated deletedObjects:chunkDeleted];
+        }
+        
+        if (chunkResults != nil) {
+            NSMutableSet *objects = [[NSMutableSet alloc] initWithCapacity:count];
+            [objects addObjectsFromArray:chunkInserted];
+            [objects addObjectsFromArray:chunkUpdated];
+            [objects addObjectsFromArray:chunkDeleted];
+            [chunkResults addObject:@[ objects, error ?: [NSNull null] ]];
+        }
+        
+        // size the next chunk from how long this one took, growing by at most double so that one fast chunk doesn't overshoot
+        if (maximumDuration > 0.0 && duration > 0.0) {
+            double nextChunkSize = MIN(maximumDuration / (duration / count), count * 2.0);
+            chunkSize = MIN(maximumChangeCount, (NSUInteger)MAX(nextChunkSize, 1.0));
+        }
+    }
+    
+    pthread_mutex_unlock(&_saveLock);
+    
+    for (NSArray *result in chunkResults) {
+        NSError *error = result[1] != [NSNull null] ? result[1] : nil;
+        chunkHandler(result[0], error);
+    }
+    
+    if (success) {
+        OSAtomicAnd32Barrier(0, (volatile uint32_t *)&_failedSaveCount);
+    } else {
+        [self _scheduleSaveRetry];
+    }
+    
+    [_checkpointer scheduleIdleCheckpoint];
+    
+    return success;
+}
+
+// Schedules a save for changes that were put back after a failed chunk. The delay doubles with each failed save in a row, so that
+// a change that can never be saved doesn't keep the database busy.
+- (void)_scheduleSaveRetry
+{
+    int32_t failedSaveCount = OSAtomicIncrement32Barrier(&_failedSaveCount);
+    NSTimeInterval delay = MIN(TNKSaveRetryDelay * pow(2.0, MIN(failedSaveCount - 1, 16)), TNKMaximumSaveRetryDelay);
     
-    [_databaseQueue inTransaction:^(FMDatabase *db, BOOL *rollback) {
-        for (TNKObject *object in insertedObjects) {
-            [object insertIntoDatabase:db];
+    __weak TNKConnection *weakSelf = self;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        [weakSelf setNeedsSave];
+    });
+}
+
+// Saves a chunk in it's own transaction. Each chunk gets a separate turn on the database queue, so queued reads can run between
+// them. Returns the error if the chunk was rolled back.
+- (NSError *)_saveChunkWithInsertedObjects:(NSArray *)insertedObjects updatedObjects:(NSArray *)updatedObjects deletedObjects:(NSArray *)deletedObjects synchronous:(int)synchronous
+{
+    NSMapTable *insertedObjectsByClass = [self.class _objectsByClass:insertedObjects];
+    NSMapTable *updatedObjectsByClass = [self.class _objectsByClass:updatedObjects];
+    NSMapTable *deletedObjectsByClass = [self.class _objectsByClass:deletedObjects];
+    
+    __block NSError *error = nil;
+    [_databaseQueue inDatabase:^(FMDatabase *db) {
+        // the synchronous level can't be changed inside of a transaction, and only applies to this save
+        if (synchronous != _defaultSynchronous) {
+            [db executeUpdate:[NSString stringWithFormat:@"PRAGMA synchronous = %d", synchronous]];
+        }
+        
+        BOOL success = [db beginTransaction];
+        
+        for (Class class in insertedObjectsByClass) {
+            NSArray *objects = [insertedObjectsByClass objectForKey:class];
+            success = success && [self _moveObjectIDsOfObjects:objects class:class usedInDatabase:db];
+            success = success && [class insertObjects:objects intoDatabase:db];
+        }
+        
+        for (Class class in updatedObjectsByClass) {
+            success = success && [class updateObjects:[updatedObjectsByClass objectForKey:class] inDatabase:db];
         }
         
-        for (TNKObject *object in updatedObjects) {
-            [object updateInDatabase:db];
+        for (Class class in deletedObjectsByClass) {
+            success = success && [class deleteObjects:[deletedObjectsByClass objectForKey:class] fromDatabase:db];
         }
         
-        for (TNKObject *object in deletedObjects) {
-            [object deleteFromDatabase:db];
+        success = success && [db commit];
+        
+        if (!success) {
+            error = [db lastError];
+            [db rollback];
+        }
+        
+        if (synchronous != _defaultSynchronous) {
+            [db executeUpdate:[NSString stringWithFormat:@"PRAGMA synchronous = %d", _defaultSynchronous]];
         }
     }];
+    
+    return error;
 }
 
+// Another connection to the same file, possibly in another process, may have inserted rows with ids that we allocated. This is
+// called inside of the save's transaction, so no one else can insert until it commits. The allocator is moved past the largest
+// id in the table, and objects whose allocated ids are already in use are given new ones. Ids that were set by the app are left
+// alone, and fail the insert like before.
+- (BOOL)_moveObjectIDsOfObjects:(NSArray *)objects class:(Class)class usedInDatabase:(FMDatabase *)db
+{
+    TNKObjectIDAllocator *allocator = [_objectIDAllocators objectForKey:class];
+    if (allocator == nil) {
+        return YES;
+    }
+    
+    TNKEntityDescription *entity = [class entityDescription];
+    FMResultSet *result = [db executeQuery:[NSString stringWithFormat:@"SELECT MAX(objectID) FROM %@", entity.tableName]];
+    if (result == nil) {
+        return NO;
+    }
+    int64_t lastObjectID = [result next] ? [result longLongIntForColumnIndex:0] : 0;
+    [result close];
+    
+    [allocator reserveObjectID:(NSUInteger)MAX(lastObjectID, 0)];
+    
+    NSMutableArray *candidates = [NSMutableArray new];
+    NSMutableArray *candidateIDs = [NSMutableArray new];
+    for (TNKObject *object in objects) {
+        NSUInteger objectID = object.objectID;
+        if ((object.state & TNKObjectStateAllocatedObjectID) != 0 && (int64_t)objectID <= lastObjectID) {
+            [candidates addObject:object];
+            [candidateIDs addObject:[NSString stringWithFormat:@"%llu", (unsigned long long)objectID]];
+        }
+    }
+    
+    if (candidates.count == 0) {
+        return YES;
+    }
+    
+    // the ids are our own integers, so they are written into the statement instead of bound
+    NSMutableSet *usedObjectIDs = [NSMutableSet new];
+    result = [db executeQuery:[NSString stringWithFormat:@"SELECT objectID FROM %@ WHERE objectID IN (%@)", entity.tableName, [candidateIDs componentsJoinedByString:@", "]]];
+    if (result == nil) {
+        return NO;
+    }
+    while ([result next]) {
+        [usedObjectIDs addObject:@([result unsignedLongLongIntForColumnIndex:0])];
+    }
+    [result close];
+    
+    TNKIdentityMap *identityMap = [self identityMapForClass:class];
+    NSUInteger primaryKeyCount = MAX(entity.primaryKeyProperties.count, 1);
+    for (TNKObject *object in candidates) {
+        if (![usedObjectIDs containsObject:@((unsigned long long)object.objectID)]) {
+            continue;
+        }
+        
+        TNKSlot primaryKeyValues[primaryKeyCount];
+        [object getPrimaryKeyValues:primaryKeyValues];
+        [identityMap unregisterObject:object withPrimaryKeyValues:primaryKeyValues];
+        [identityMap releasePrimaryKeyValues:primaryKeyValues];
+        
+        [object replaceAllocatedObjectID:[allocator nextObjectID]];
+        [identityMap registerObject:object];
+    }
+    
+    return YES;
+}
+
+// Puts the changes of a failed chunk back, so that they are retried by the next save. The save that failed schedules the retry
+// once it is done, see _scheduleSaveRetry.
+- (void)_requeueInsertedObjects:(NSArray *)insertedObjects updatedObjects:(NSArray *)updatedObjects deletedObjects:(NSArray *)deletedObjects
+{
+    for (TNKObject *object in insertedObjects) {
+        [object addState:TNKObjectStateInserted];
+        [self _requeueObject:object toShards:_insertedObjects];
+    }
+    for (TNKObject *object in updatedObjects) {
+        // already queued again if it was changed during the save
+        if ([object addState:TNKObjectStateUpdated]) {
+            [self _requeueObject:object toShards:_updatedObjects];
+        }
+    }
+    for (TNKObject *object in deletedObjects) {
+        [self _requeueObject:object toShards:_deletedObjects];
+    }
+    
+    OSAtomicCompareAndSwap32Barrier(0, 1, &_needsSave);
+}
+
+- (void)_requeueObject:(TNKObject *)object toShards:(NSArray *)shards
+{
+    NSUInteger shard = TNKChangeShardForObject(object);
+    
+    pthread_mutex_lock(&_changeLocks[shard]);
+    [shards[shard] addObject:object];
+    pthread_mutex_unlock(&_changeLocks[shard]);
+    
+    OSAtomicIncrement64Barrier(&_pendingChangeCount);
+    OSAtomicAdd64Barrier((int64_t)[object.class entityDescription].estimatedRowSize, &_estimatedPendingBytes);
+}
 
-#pragma mark - Notifications
++ (int64_t)_estimatedSizeOfObjects:(id<NSFastEnumeration>)objects
+{
+    int64_t size = 0;
+    for (TNKObject *object in objects) {
+        size += [object.class entityDescription].estimatedRowSize;
+    }
+    
+    return size;
+}
 
-#ifdef TARGET_OS_IPHONE
-- (void)applicationWillResignActive:(NSNotification *)notification
++ (NSMapTable *)_objectsByClass:(NSArray *)objects
 {
-    _saveTask = [[UIApplication sharedApplication] beginBackgroundTaskWithName:@"TNKConnection-save" expirationHandler:nil];
-    [self triggerSave];
+    NSMapTable *objectsByClass = [NSMapTable strongToStrongObjectsMapTable];
+    for (TNKObject *object in objects) {
+        NSMutableArray *classObjects = [objectsByClass objectForKey:object.class];
+        if (classObjects == nil) {
+            classObjects = [NSMutableArray new];
+            [objectsByClass setObject:classObjects forKey:object.class];
+        }
+        [classObjects addObject:object];
+    }
+    
+    return objectsByClass;
 }
-#endif
 
 @end
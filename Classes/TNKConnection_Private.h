@@ -9,6 +9,8 @@
 #import "TNKConnection.h"
 
 @class TNKObject;
+@class TNKIdentityMap;
+@class FMDatabase;
 @class FMDatabaseQueue;
 
 
@@ -22,6 +24,13 @@
  */
 - (void)registerObject:(TNKObject *)object;
 
+/** The registered objects of a class
+ 
+ @param objectClass A `TNKObject` subclass.
+ @return The identity map for the class, which is created the first time it is needed.
+ */
+- (TNKIdentityMap *)identityMapForClass:(Class)objectClass;
+
 /** Insert a new object into the database.
  
  This is called when a new object is created.
@@ -47,8 +56,32 @@
 - (void)deleteObject:(TNKObject *)object;
 
 
-/** The internal database queue all queries must be run in
+/** The internal database queue all writes must be run in
  */
 @property (nonatomic, readonly) FMDatabaseQueue *databaseQueue;
 
+/** Run a block with a database to read from
+ 
+ File databases are opened in WAL mode with a small pool of read only connections, so reads don't wait for a save to finish.
+ The block is run on the current thread, and waits if all of the readers are in use. In memory databases read from
+ `databaseQueue`.
+ 
+ @param block A block that reads from the database. Do not write to the database in the block.
+ */
+- (void)performRead:(void(^)(FMDatabase *db))block;
+
+/** Checkpoint the database now
+ 
+ Waits for the checkpoint to finish. Does nothing unless the database is a file in WAL mode.
+ 
+ @param truncate Use a truncating checkpoint regardless of the size of the WAL.
+ */
+- (void)checkpointAndTruncate:(BOOL)truncate;
+
+/** Save the connection with `autosaveDurability` if it has any changes
+ 
+ This is called by the `saveScheduler` on it's queue.
+ */
+- (void)autosave;
+
 @end
@@ -13,5 +13,9 @@
 #import "TNKConnection.h"
 #import "TNKObject.h"
 #import "TNKObjectQuery.h"
+#import "TNKPagedArray.h"
+#import "TNKAggregateQuery.h"
+#import "TNKSaveScheduler.h"
 
 #import "NSPredicate+TNKWhereClause.h"
+#import "NSSortDescriptor+TNKOrderClause.h"
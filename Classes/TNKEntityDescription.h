@@ -0,0 +1,142 @@
+//
+//  TNKEntityDescription.h
+//  Pods
+//
+//  Created by David Beck on 7/22/14.
+//
+//
+
+#import <Foundation/Foundation.h>
+
+
+/** How the value of a property is stored in a `TNKObject`
+ */
+typedef NS_ENUM(NSUInteger, TNKPropertyStorage) {
+    /** A retained object. */
+    TNKPropertyStorageObject,
+    /** A signed integer, stored as an int64_t. Used for all signed integer types and bools. */
+    TNKPropertyStorageInteger,
+    /** An unsigned integer, stored as a uint64_t. */
+    TNKPropertyStorageUnsignedInteger,
+    /** A floating point number, stored as a double. Used for floats and doubles. */
+    TNKPropertyStorageDouble,
+};
+
+
+/** Metadata for a single persistent key of a `TNKObject` subclass
+ 
+ Property descriptions are created once per class by `TNKEntityDescription` and are immutable after that. They cache everything
+ that would otherwise need to be looked up with the Objective-C runtime each time a persistent property is accessed.
+ */
+@interface TNKPropertyDescription : NSObject
+
+/** The persistent key (and column name) of the property.
+ */
+@property (nonatomic, readonly, copy) NSString *name;
+
+/** The ordinal of the property in it's entity.
+ 
+ This is the index of the receiver in `-[TNKEntityDescription properties]`.
+ */
+@property (nonatomic, readonly) NSUInteger index;
+
+/** The first character of the Objective-C type encoding of the property.
+ 
+ '@' for object properties, or one of the scalar codes such as 'i', 'Q' or 'd'.
+ */
+@property (nonatomic, readonly) char typeEncoding;
+
+/** How values of the property are stored.
+ 
+ Derived from `typeEncoding`.
+ */
+@property (nonatomic, readonly) TNKPropertyStorage storage;
+
+/** The class of values for the property.
+ 
+ For object properties this is the declared class, or Nil if the property is declared as `id`. For scalar properties this is
+ `NSNumber`.
+ */
+@property (nonatomic, readonly) Class valueClass;
+
+/** The SQLite column type, as returned by `+[TNKObject sqliteTypeForPersistentKey:]`.
+ */
+@property (nonatomic, readonly, copy) NSString *sqliteType;
+
+/** The getter for the property.
+ */
+@property (nonatomic, readonly) SEL getter;
+
+/** The setter for the property.
+ */
+@property (nonatomic, readonly) SEL setter;
+
+/** If the property is declared readonly.
+ */
+@property (nonatomic, readonly, getter=isReadonly) BOOL readonly;
+
+/** If the property is one of the classes `primaryKeys`.
+ */
+@property (nonatomic, readonly, getter=isPrimaryKey) BOOL primaryKey;
+
+@end
+
+
+/** Metadata for a `TNKObject` subclass
+ 
+ An entity description is built once for each class, the first time it is needed. `TNKConnection` builds the description for each
+ of it's classes when it is created, so that none of the introspection happens while objects are being used.
+ */
+@interface TNKEntityDescription : NSObject
+
+/** The entity description for a class
+ 
+ The description is created the first time this is called for a class and cached after that.
+ 
+ @param objectClass A `TNKObject` subclass.
+ @return The entity description for the class.
+ */
++ (instancetype)entityForClass:(Class)objectClass;
+
+/** The class the entity describes.
+ */
+@property (nonatomic, readonly) Class objectClass;
+
+/** The table name, as returned by `+[TNKObject sqliteTableName]`.
+ */
+@property (nonatomic, readonly, copy) NSString *tableName;
+
+/** All the persistent properties of the class.
+ 
+ An array of `TNKPropertyDescription`s ordered by their `index`.
+ */
+@property (nonatomic, readonly, copy) NSArray *properties;
+
+/** The persistent properties that make up the primary key.
+ 
+ An array of `TNKPropertyDescription`s ordered by their `index`.
+ */
+@property (nonatomic, readonly, copy) NSArray *primaryKeyProperties;
+
+/** A rough estimate of the size of a row, in bytes.
+ 
+ Numbers count as 8 bytes, and objects by a typical size for their class. Used to decide when pending changes are large enough to
+ save early.
+ */
+@property (nonatomic, readonly) NSUInteger estimatedRowSize;
+
+/** Lookup a property by it's persistent key
+ 
+ @param key The persistent key.
+ @return The property for the key, or nil if the key is not persistent.
+ */
+- (TNKPropertyDescription *)propertyForKey:(NSString *)key;
+
+/** Lookup a property by it's getter or setter
+ 
+ @param selector The getter or setter of a persistent property.
+ @return The property for the selector, or nil if the selector is not an accessor of a persistent property.
+ */
+- (TNKPropertyDescription *)propertyForSelector:(SEL)selector;
+
+@end
@@ -0,0 +1,201 @@
+//
+//  TNKEntityDescription.m
+//  Pods
+//
+//  Created by David Beck on 7/22/14.
+//
+//
+
+#import "TNKEntityDescription.h"
+
+#import <objc/runtime.h>
+
+#import "TNKData.h"
+#import "TNKObject_Private.h"
+
+
+@interface TNKPropertyDescription ()
+
+@property (nonatomic, readwrite, copy) NSString *name;
+@property (nonatomic, readwrite) NSUInteger index;
+@property (nonatomic, readwrite) char typeEncoding;
+@property (nonatomic, readwrite) TNKPropertyStorage storage;
+@property (nonatomic, readwrite) Class valueClass;
+@property (nonatomic, readwrite, copy) NSString *sqliteType;
+@property (nonatomic, readwrite) SEL getter;
+@property (nonatomic, readwrite) SEL setter;
+@property (nonatomic, readwrite, getter=isReadonly) BOOL readonly;
+@property (nonatomic, readwrite, getter=isPrimaryKey) BOOL primaryKey;
+
+@end
+
+@implementation TNKPropertyDescription
+
++ (TNKPropertyStorage)_storageForTypeEncoding:(char)typeEncoding
+{
+    switch (typeEncoding) {
+        case 'c':
+        case 's':
+        case 'i':
+        case 'l':
+        case 'q':
+        case 'B':
+            return TNKPropertyStorageInteger;
+        case 'C':
+        case 'S':
+        case 'I':
+        case 'L':
+        case 'Q':
+            return TNKPropertyStorageUnsignedInteger;
+        case 'f':
+        case 'd':
+            return TNKPropertyStorageDouble;
+        default:
+            return TNKPropertyStorageObject;
+    }
+}
+
+- (NSUInteger)_estimatedSize
+{
+    if (self.storage != TNKPropertyStorageObject) {
+        return sizeof(TNKSlot);
+    }
+    
+    if ([self.valueClass isSubclassOfClass:[NSString class]]) {
+        return 32;
+    } else if ([self.valueClass isSubclassOfClass:[NSData class]]) {
+        return 256;
+    } else {
+        return 16;
+    }
+}
+
+- (NSString *)description
+{
+    return [NSString stringWithFormat:@"<%@: %p %@[%lu] %c %@>", NSStringFromClass(self.class), self, self.name, (unsigned long)self.index, self.typeEncoding, self.sqliteType];
+}
+
+@end
+
+
+@interface TNKEntityDescription ()
+{
+    NSDictionary *_propertiesByName;
+    CFMutableDictionaryRef _propertiesBySelector;
+}
+
+@end
+
+@implementation TNKEntityDescription
+
+static char TNKEntityDescriptionKey;
+
++ (instancetype)entityForClass:(Class)objectClass
+{
+    TNKEntityDescription *entity = objc_getAssociatedObject(objectClass, &TNKEntityDescriptionKey);
+    
+    if (entity == nil) {
+        @synchronized(objectClass) {
+            entity = objc_getAssociatedObject(objectClass, &TNKEntityDescriptionKey);
+            
+            if (entity == nil) {
+                entity = [[self alloc] initWithObjectClass:objectClass];
+                objc_setAssociatedObject(objectClass, &TNKEntityDescriptionKey, entity, OBJC_ASSOCIATION_RETAIN);
+            }
+        }
+    }
+    
+    return entity;
+}
+
+- (instancetype)init
+{
+    NSAssert(NO, @"You cannot call init on TNKEntityDescription without an object class.");
+    return nil;
+}
+
+- (instancetype)initWithObjectClass:(Class)objectClass
+{
+    self = [super init];
+    if (self) {
+        _objectClass = objectClass;
+        _tableName = [[objectClass sqliteTableName] copy];
+        
+        // sorted so that column ordinals are stable between launches
+        NSArray *keys = [[[objectClass persistentKeys] allObjects] sortedArrayUsingSelector:@selector(compare:)];
+        NSSet *primaryKeys = [objectClass primaryKeys];
+        
+        NSMutableArray *properties = [[NSMutableArray alloc] initWithCapacity:keys.count];
+        NSMutableArray *primaryKeyProperties = [NSMutableArray new];
+        NSMutableDictionary *propertiesByName = [[NSMutableDictionary alloc] initWithCapacity:keys.count];
+        _propertiesBySelector = CFDictionaryCreateMutable(NULL, keys.count * 2, NULL, &kCFTypeDictionaryValueCallBacks);
+        
+        for (NSString *key in keys) {
+            NSString *type = [objectClass _typeForPersistentKey:key];
+            
+            TNKPropertyDescription *property = [TNKPropertyDescription new];
+            property.name = key;
+            property.index = properties.count;
+            property.typeEncoding = type.length > 0 ? (char)[type characterAtIndex:0] : '@';
+            property.storage = [TNKPropertyDescription _storageForTypeEncoding:property.typeEncoding];
+            property.valueClass = [objectClass _classForPersistentKey:key];
+            property.sqliteType = [objectClass sqliteTypeForPersistentKey:key];
+            property.getter = [objectClass _getterForPersistentKey:key];
+            property.setter = [objectClass _setterForPersistentKey:key];
+            property.readonly = [objectClass _persistentKeyIsReadonly:key];
+            property.primaryKey = [primaryKeys containsObject:key];
+            
+            [properties addObject:property];
+            propertiesByName[key] = property;
+            _estimatedRowSize += [property _estimatedSize];
+            if (property.isPrimaryKey) {
+                [primaryKeyProperties addObject:property];
+            }
+            
+            if (property.getter != NULL) {
+                CFDictionarySetValue(_propertiesBySelector, property.getter, (__bridge const void *)property);
+            }
+            if (property.setter != NULL && !property.isReadonly) {
+                CFDictionarySetValue(_propertiesBySelector, property.setter, (__bridge const void *)property);
+            }
+        }
+        
+        _properties = [properties copy];
+        _primaryKeyProperties = [primaryKeyProperties copy];
+        _propertiesByName = [propertiesByName copy];
+    }
+    
+    return self;
+}
+
+- (void)dealloc
+{
+    if (_propertiesBySelector != NULL) {
+        CFRelease(_propertiesBySelector);
+    }
+}
+
+- (TNKPropertyDescription *)propertyForKey:(NSString *)key
+{
+    if (key == nil) {
+        return nil;
+    }
+    
+    return _propertiesByName[key];
+}
+
+- (TNKPropertyDescription *)propertyForSelector:(SEL)selector
+{
+    if (selector == NULL) {
+        return nil;
+    }
+    
+    return (__bridge TNKPropertyDescription *)CFDictionaryGetValue(_propertiesBySelector, selector);
+}
+
+- (NSString *)description
+{
+    return [NSString stringWithFormat:@"<%@: %p %@ %@>", NSStringFromClass(self.class), self, self.tableName, self.properties];
+}
+
+@end
@@ -0,0 +1,89 @@
+//
+//  TNKIdentityMap.h
+//  Pods
+//
+//  Created by David Beck on 7/22/14.
+//
+//
+
+#import <Foundation/Foundation.h>
+
+#import "TNKObject_Private.h"
+
+@class TNKEntityDescription;
+
+
+/** The registered objects of a single class in a connection
+ 
+ Objects are keyed by the native values of their primary keys, stored the same way the objects store their persistent values.
+ Classes with a single integer primary key (like the default `objectID`) are hashed directly by that integer, and other classes
+ by a tuple of their primary key values. Keys for lookups live on the stack, so finding an object doesn't allocate or format a
+ key.
+ 
+ Objects are held weakly. An identity map can be used from any thread. The objects are split into shards by the hash of their
+ key, each with it's own lock.
+ */
+@interface TNKIdentityMap : NSObject
+
+/** Create an identity map for a class
+ 
+ @param entity The entity description of the class.
+ @return A new, empty identity map.
+ */
+- (instancetype)initWithEntity:(TNKEntityDescription *)entity;
+
+/** The entity description of the objects in the map.
+ */
+@property (nonatomic, readonly) TNKEntityDescription *entity;
+
+/** Find an object by the values of it's primary keys
+ 
+ @param values The values of the entity's `primaryKeyProperties`, in the same order.
+ @return The registered object, or nil if there isn't one.
+ */
+- (id)objectForPrimaryKeyValues:(const TNKSlot *)values;
+
+/** Find an object by a dictionary of primary key values
+ 
+ The values are converted to the storage of their properties, so for instance `@(1)` will match an objectID of 1.
+ 
+ @param primaryValues A dictionary of all the primary keys of the entity.
+ @return The registered object, or nil if there isn't one or a primary key is missing.
+ */
+- (id)objectForPrimaryValues:(NSDictionary *)primaryValues;
+
+/** Register an object under it's current primary key
+ 
+ If another object is registered with the same primary key, it is replaced.
+ 
+ @param object An instance of the entity's class.
+ */
+- (void)registerObject:(TNKObject *)object;
+
+/** Register a batch of objects, such as the results of a query
+ 
+ Each shard is locked once for the whole batch. Unlike `registerObject:`, objects that are already registered are kept, so that
+ two threads loading the same row end up with the same instance.
+ 
+ @param objects Instances of the entity's class.
+ @return The registered objects, in the same order. This is the object that was passed in unless another object was already
+ registered with the same primary key.
+ */
+- (NSArray *)registerObjects:(NSArray *)objects;
+
+/** Remove an object that was registered under an old primary key
+ 
+ Nothing is removed if a different object is registered with the key.
+ 
+ @param object The object to remove.
+ @param values The values of the entity's `primaryKeyProperties` that the object was registered with, in the same order.
+ */
+- (void)unregisterObject:(TNKObject *)object withPrimaryKeyValues:(const TNKSlot *)values;
+
+/** Release the object values in an array of primary key values
+ 
+ @param values The values of the entity's `primaryKeyProperties`, in the same order. Object values are released and set to NULL.
+ */
+- (void)releasePrimaryKeyValues:(TNKSlot *)values;
+
+@end
@@ -0,0 +1,372 @@
+//
+//  TNKIdentityMap.m
+//  Pods
+//
+//  Created by David Beck on 7/22/14.
+//
+//
+
+#import "TNKIdentityMap.h"
+
+#import <pthread.h>
+
+#import "TNKEntityDescription.h"
+
+
+// The primary key of an object. Keys used for lookups point to values on the stack, keys stored in the map own a copy of their
+// values (and retain any objects in them).
+typedef struct {
+    NSUInteger count;
+    const TNKPropertyStorage *storage;
+    TNKSlot *values;
+} TNKIdentityKey;
+
+
+#pragma mark - Key Functions
+
+static void *TNKIdentityKeyAcquire(const void *src, NSUInteger (*size)(const void *item), BOOL shouldCopy)
+{
+    const TNKIdentityKey *key = src;
+    
+    // the values are allocated along with the key, so it can be freed all at once
+    TNKIdentityKey *copy = malloc(sizeof(TNKIdentityKey) + sizeof(TNKSlot) * key->count);
+    copy->count = key->count;
+    copy->storage = key->storage;
+    copy->values = (TNKSlot *)(copy + 1);
+    
+    for (NSUInteger index = 0; index < key->count; index++) {
+        copy->values[index] = key->values[index];
+        if (key->storage[index] == TNKPropertyStorageObject && key->values[index].objectValue != NULL) {
+            CFRetain(key->values[index].objectValue);
+        }
+    }
+    
+    return copy;
+}
+
+static void TNKIdentityKeyRelinquish(const void *item, NSUInteger (*size)(const void *item))
+{
+    TNKIdentityKey *key = (TNKIdentityKey *)item;
+    
+    for (NSUInteger index = 0; index < key->count; index++) {
+        if (key->storage[index] == TNKPropertyStorageObject && key->values[index].objectValue != NULL) {
+            CFRelease(key->values[index].objectValue);
+        }
+    }
+    
+    free(key);
+}
+
+// single integer keys, like the default objectID
+
+static NSUInteger TNKIntegerKeyHash(const void *item, NSUInteger (*size)(const void *item))
+{
+    const TNKIdentityKey *key = item;
+    
+    return (NSUInteger)key->values[0].unsignedIntegerValue;
+}
+
+static BOOL TNKIntegerKeyIsEqual(const void *item1, const void *item2, NSUInteger (*size)(const void *item))
+{
+    const TNKIdentityKey *key1 = item1;
+    const TNKIdentityKey *key2 = item2;
+    
+    return key1->values[0].integerValue == key2->values[0].integerValue;
+}
+
+// any other combination of keys
+
+static NSUInteger TNKSlotHash(TNKPropertyStorage storage, TNKSlot slot)
+{
+    switch (storage) {
+        case TNKPropertyStorageObject:
+            return slot.objectValue != NULL ? [(__bridge id)slot.objectValue hash] : 0;
+        case TNKPropertyStorageDouble:
+            // 0.0 and -0.0 are equal, but have different bits
+            return slot.doubleValue == 0.0 ? 0 : (NSUInteger)slot.unsignedIntegerValue;
+        case TNKPropertyStorageInteger:
+        case TNKPropertyStorageUnsignedInteger:
+            return (NSUInteger)slot.unsignedIntegerValue;
+    }
+}
+
+static BOOL TNKSlotIsEqual(TNKPropertyStorage storage, TNKSlot slot1, TNKSlot slot2)
+{
+    switch (storage) {
+        case TNKPropertyStorageObject:
+            return slot1.objectValue == slot2.objectValue || (slot1.objectValue != NULL && slot2.objectValue != NULL && [(__bridge id)slot1.objectValue isEqual:(__bridge id)slot2.objectValue]);
+        case TNKPropertyStorageDouble:
+            return slot1.doubleValue == slot2.doubleValue;
+        case TNKPropertyStorageInteger:
+        case TNKPropertyStorageUnsignedInteger:
+            return slot1.integerValue == slot2.integerValue;
+    }
+}
+
+static NSUInteger TNKCompositeKeyHash(const void *item, NSUInteger (*size)(const void *item))
+{
+    const TNKIdentityKey *key = item;
+    
+    NSUInteger hash = 0;
+    for (NSUInteger index = 0; index < key->count; index++) {
+        hash = hash * 31 + TNKSlotHash(key->storage[index], key->values[index]);
+    }
+    
+    return hash;
+}
+
+static BOOL TNKCompositeKeyIsEqual(const void *item1, const void *item2, NSUInteger (*size)(const void *item))
+{
+    const TNKIdentityKey *key1 = item1;
+    const TNKIdentityKey *key2 = item2;
+    
+    if (key1->count != key2->count) {
+        return NO;
+    }
+    
+    for (NSUInteger index = 0; index < key1->count; index++) {
+        if (!TNKSlotIsEqual(key1->storage[index], key1->values[index], key2->values[index])) {
+            return NO;
+        }
+    }
+    
+    return YES;
+}
+
+
+// Objects are split between shards by the hash of their key, each with it's own lock, so threads registering and finding
+// different objects rarely wait on each other.
+#define TNKIdentityMapShardBits 3
+#define TNKIdentityMapShardCount (1 << TNKIdentityMapShardBits)
+
+NS_INLINE NSUInteger TNKIdentityMapShardForHash(NSUInteger hash)
+{
+    // uses the high bits of a fibonacci hash, so that each shard's map table still gets keys spread over all of the low bits
+    return (NSUInteger)(((uint64_t)hash * 0x9E3779B97F4A7C15ULL) >> (64 - TNKIdentityMapShardBits));
+}
+
+
+@interface TNKIdentityMap ()
+{
+    NSUInteger _primaryKeyCount;
+    TNKPropertyStorage *_primaryKeyStorage;
+    NSUInteger (*_hashFunction)(const void *item, NSUInteger (*size)(const void *item));
+    
+    NSArray *_shards;
+    pthread_mutex_t _locks[TNKIdentityMapShardCount];
+}
+
+@end
+
+@implementation TNKIdentityMap
+
+- (instancetype)init
+{
+    NSAssert(NO, @"You cannot call init on TNKIdentityMap without an entity.");
+    return nil;
+}
+
+- (instancetype)initWithEntity:(TNKEntityDescription *)entity
+{
+    self = [super init];
+    if (self) {
+        _entity = entity;
+        
+        // the keys point to this instead of each having their own copy
+        _primaryKeyCount = entity.primaryKeyProperties.count;
+        _primaryKeyStorage = calloc(MAX(_primaryKeyCount, 1), sizeof(TNKPropertyStorage));
+        [entity.primaryKeyProperties enumerateObjectsUsingBlock:^(TNKPropertyDescription *property, NSUInteger index, BOOL *stop) {
+            _primaryKeyStorage[index] = property.storage;
+        }];
+        
+        NSPointerFunctions *keyFunctions = [NSPointerFunctions pointerFunctionsWithOptions:NSPointerFunctionsOpaqueMemory | NSPointerFunctionsOpaquePersonality];
+        keyFunctions.acquireFunction = TNKIdentityKeyAcquire;
+        keyFunctions.relinquishFunction = TNKIdentityKeyRelinquish;
+        if (_primaryKeyCount == 1 && (_primaryKeyStorage[0] == TNKPropertyStorageInteger || _primaryKeyStorage[0] == TNKPropertyStorageUnsignedInteger)) {
+            keyFunctions.hashFunction = TNKIntegerKeyHash;
+            keyFunctions.isEqualFunction = TNKIntegerKeyIsEqual;
+        } else {
+            keyFunctions.hashFunction = TNKCompositeKeyHash;
+            keyFunctions.isEqualFunction = TNKCompositeKeyIsEqual;
+        }
+        _hashFunction = keyFunctions.hashFunction;
+        
+        NSPointerFunctions *valueFunctions = [NSPointerFunctions pointerFunctionsWithOptions:NSPointerFunctionsWeakMemory | NSPointerFunctionsObjectPersonality];
+        
+        NSMutableArray *shards = [[NSMutableArray alloc] initWithCapacity:TNKIdentityMapShardCount];
+        for (NSUInteger shard = 0; shard < TNKIdentityMapShardCount; shard++) {
+            [shards addObject:[[NSMapTable alloc] initWithKeyPointerFunctions:keyFunctions valuePointerFunctions:valueFunctions capacity:0]];
+            pthread_mutex_init(&_locks[shard], NULL);
+        }
+        _shards = [shards copy];
+    }
+    
+    return self;
+}
+
+- (void)dealloc
+{
+    for (NSUInteger shard = 0; shard < TNKIdentityMapShardCount; shard++) {
+        pthread_mutex_destroy(&_locks[shard]);
+    }
+    free(_primaryKeyStorage);
+}
+
+- (TNKIdentityKey)_keyWithValues:(const TNKSlot *)values
+{
+    return (TNKIdentityKey){ .count = _primaryKeyCount, .storage = _primaryKeyStorage, .values = (TNKSlot *)values };
+}
+
+- (id)objectForPrimaryKeyValues:(const TNKSlot *)values
+{
+    TNKIdentityKey key = [self _keyWithValues:values];
+    NSUInteger shard = TNKIdentityMapShardForHash(_hashFunction(&key, NULL));
+    
+    pthread_mutex_lock(&_locks[shard]);
+    id object = [_shards[shard] objectForKey:(__bridge id)(void *)&key];
+    pthread_mutex_unlock(&_locks[shard]);
+    
+    return object;
+}
+
+- (id)objectForPrimaryValues:(NSDictionary *)primaryValues
+{
+    TNKSlot values[MAX(_primaryKeyCount, 1)];
+    
+    NSUInteger index = 0;
+    for (TNKPropertyDescription *property in self.entity.primaryKeyProperties) {
+        id value = primaryValues[property.name];
+        if (value == nil) {
+            return nil;
+        } else if (value == [NSNull null]) {
+            value = nil;
+        }
+        
+        // the dictionary keeps the values alive for us
+        switch (property.storage) {
+            case TNKPropertyStorageObject:
+                values[index].objectValue = (__bridge void *)value;
+                break;
+            case TNKPropertyStorageInteger:
+                values[index].integerValue = [value longLongValue];
+                break;
+            case TNKPropertyStorageUnsignedInteger:
+                values[index].unsignedIntegerValue = [value unsignedLongLongValue];
+                break;
+            case TNKPropertyStorageDouble:
+                values[index].doubleValue = [value doubleValue];
+                break;
+        }
+        
+        index++;
+    }
+    
+    return [self objectForPrimaryKeyValues:values];
+}
+
+- (void)registerObject:(TNKObject *)object
+{
+    // the object is locked to read it's values, so that is done before we take our own lock
+    TNKSlot values[MAX(_primaryKeyCount, 1)];
+    [object getPrimaryKeyValues:values];
+    TNKIdentityKey key = [self _keyWithValues:values];
+    NSUInteger shard = TNKIdentityMapShardForHash(_hashFunction(&key, NULL));
+    
+    pthread_mutex_lock(&_locks[shard]);
+    [_shards[shard] setObject:object forKey:(__bridge id)(void *)&key];
+    pthread_mutex_unlock(&_locks[shard]);
+    
+    [self releasePrimaryKeyValues:values];
+}
+
+- (NSArray *)registerObjects:(NSArray *)objects
+{
+    NSUInteger count = objects.count;
+    if (count == 0) {
+        return objects;
+    }
+    
+    // read all the keys before taking any of our locks
+    NSUInteger stride = MAX(_primaryKeyCount, 1);
+    TNKSlot *values = malloc(sizeof(TNKSlot) * stride * count);
+    NSUInteger *objectShards = malloc(sizeof(NSUInteger) * count);
+    for (NSUInteger index = 0; index < count; index++) {
+        [objects[index] getPrimaryKeyValues:&values[index * stride]];
+        
+        TNKIdentityKey key = [self _keyWithValues:&values[index * stride]];
+        objectShards[index] = TNKIdentityMapShardForHash(_hashFunction(&key, NULL));
+    }
+    
+    // each shard is locked once for all of it's objects
+    NSMutableArray *registeredObjects = [objects mutableCopy];
+    for (NSUInteger shard = 0; shard < TNKIdentityMapShardCount; shard++) {
+        BOOL locked = NO;
+        
+        for (NSUInteger index = 0; index < count; index++) {
+            if (objectShards[index] != shard) {
+                continue;
+            }
+            
+            if (!locked) {
+                pthread_mutex_lock(&_locks[shard]);
+                locked = YES;
+            }
+            
+            TNKIdentityKey key = [self _keyWithValues:&values[index * stride]];
+            id existingObject = [_shards[shard] objectForKey:(__bridge id)(void *)&key];
+            if (existingObject != nil) {
+                registeredObjects[index] = existingObject;
+            } else {
+                [_shards[shard] setObject:objects[index] forKey:(__bridge id)(void *)&key];
+            }
+        }
+        
+        if (locked) {
+            pthread_mutex_unlock(&_locks[shard]);
+        }
+    }
+    
+    for (NSUInteger index = 0; index < count; index++) {
+        [self releasePrimaryKeyValues:&values[index * stride]];
+    }
+    free(values);
+    free(objectShards);
+    
+    return registeredObjects;
+}
+
+- (void)unregisterObject:(TNKObject *)object withPrimaryKeyValues:(const TNKSlot *)values
+{
+    TNKIdentityKey key = [self _keyWithValues:values];
+    NSUInteger shard = TNKIdentityMapShardForHash(_hashFunction(&key, NULL));
+    
+    pthread_mutex_lock(&_locks[shard]);
+    if ([_shards[shard] objectForKey:(__bridge id)(void *)&key] == object) {
+        [_shards[shard] removeObjectForKey:(__bridge id)(void *)&key];
+    }
+    pthread_mutex_unlock(&_locks[shard]);
+}
+
+- (void)releasePrimaryKeyValues:(TNKSlot *)values
+{
+    for (NSUInteger index = 0; index < _primaryKeyCount; index++) {
+        if (_primaryKeyStorage[index] == TNKPropertyStorageObject && values[index].objectValue != NULL) {
+            CFRelease(values[index].objectValue);
+            values[index].objectValue = NULL;
+        }
+    }
+}
+
+- (NSString *)description
+{
+    NSUInteger count = 0;
+    for (NSUInteger shard = 0; shard < TNKIdentityMapShardCount; shard++) {
+        pthread_mutex_lock(&_locks[shard]);
+        count += [_shards[shard] count];
+        pthread_mutex_unlock(&_locks[shard]);
+    }
+    
+    return [NSString stringWithFormat:@"<%@: %p %@ %lu objects>", NSStringFromClass(self.class), self, self.entity.tableName, (unsigned long)count];
+}
+
+@end
@@ -111,10 +111,47 @@
  */
 - (void)deleteFromDatabase:(FMDatabase *)db;
 
+/** Insert several objects of the receiving class into the database
+ 
+ This is called by the connection on save with all the inserted objects of the class. Objects that have the same changed keys are
+ inserted with multi-row statements, with as many rows as SQLite's variable limit allows. If a subclass overrides
+ `insertIntoDatabase:`, that is called for each object instead.
+ 
+ @param objects The objects to insert. All of them must be instances of the receiver.
+ @param db The database to insert the objects into.
+ @return NO if any of the statements failed.
+ */
++ (BOOL)insertObjects:(NSArray *)objects intoDatabase:(FMDatabase *)db;
+
+/** Update several objects of the receiving class in the database
+ 
+ This is called by the connection on save with all the updated objects of the class. Objects that have the same changed keys share
+ a single prepared statement. If a subclass overrides `updateInDatabase:`, that is called for each object instead.
+ 
+ @param objects The objects to update. All of them must be instances of the receiver.
+ @param db The database to update the objects in.
+ @return NO if any of the statements failed.
+ */
++ (BOOL)updateObjects:(NSArray *)objects inDatabase:(FMDatabase *)db;
+
+/** Delete several objects of the receiving class from the database
+ 
+ This is called by the connection on save with all the deleted objects of the class. Classes with a single primary key delete
+ their objects with `IN` clauses, with as many keys as SQLite's variable limit allows. If a subclass overrides
+ `deleteFromDatabase:`, that is called for each object instead.
+ 
+ @param objects The objects to delete. All of them must be instances of the receiver.
+ @param db The database to delete the objects from.
+ @return NO if any of the statements failed.
+ */
++ (BOOL)deleteObjects:(NSArray *)objects fromDatabase:(FMDatabase *)db;
+
 /** Execute an SQL query to retrieve objects from the database
  
  This is called from a `TNKObjectQuery` to get the objects from the database. If you override this method you should return a
- real NSArray, with the actual objects, as `TNKObjectQuery` will handle paging results.
+ real NSArray, with the actual objects, as `TNKObjectQuery` will handle paging results. The query's `predicate`,
+ `sortDescriptors`, `limit` and `offset` are all applied by the database. Queries that return paged results read their pages
+ directly, without calling this method.
  
  @param objectQuery The query to use to generate the SQL query.
  @param db The database retrieve the objects from.
@@ -169,6 +206,36 @@
  */
 - (void)deleteObject;
 
+/** Delete every row that matches a predicate
+ 
+ The rows are deleted with a single statement, right away, without fetching the objects. Objects for matching rows that are
+ already in memory are marked as deleted, and unlike with `deleteObject`, they are no longer returned by queries. Inserting an
+ object with the same primary key creates a new object.
+ 
+ @warning *Note:* every pending change of the current connection, for every class, is saved before the statement runs, so that
+ the statement sees them. This is the same as calling `save` on the connection first.
+ 
+ @param predicate The predicate to match rows with. It is converted to SQL, so it can't use block predicates. If nil, every row is
+ deleted.
+ @return The number of rows deleted, or `NSNotFound` if the statement failed.
+ */
++ (NSUInteger)deleteObjectsMatchingPredicate:(NSPredicate *)predicate;
+
+/** Set values on every row that matches a predicate
+ 
+ The rows are updated with a single statement, right away, without fetching the objects. Objects for matching rows that are
+ already in memory get the new values, unless they were changed again while the statement ran.
+ 
+ @warning *Note:* every pending change of the current connection, for every class, is saved before the statement runs, so that
+ the statement sees them. This is the same as calling `save` on the connection first.
+ 
+ @param predicate The predicate to match rows with. It is converted to SQL, so it can't use block predicates. If nil, every row is
+ updated.
+ @param values The new values, keyed by persistent key. Use `NSNull` to set a value to nil. Primary keys can't be updated.
+ @return The number of rows updated, or `NSNotFound` if the statement failed.
+ */
++ (NSUInteger)updateObjectsMatchingPredicate:(NSPredicate *)predicate values:(NSDictionary *)values;
+
 
 /**---------------------------------------------------------------------------------------
  * @name Status information
@@ -186,6 +253,8 @@
 @property (nonatomic, readonly) BOOL isInserted;
 
 /** If the object has changes that have not been saved to the database yet.
+ 
+ Setting a property to the value that was already faulted in isn't a change.
  */
 @property (nonatomic, readonly) BOOL isUpdated;
 
@@ -197,12 +266,14 @@
 
 /** The properties, and their values, that have been faulted in
  
- This copies it's internal dictionary every time you call this, so you may want to assign it to a local variable for repeated
- use.
+ This builds a new dictionary every time you call this, so you may want to assign it to a local variable for repeated use.
+ Properties that have been faulted in as nil are left out.
  */
 @property (nonatomic, readonly) NSDictionary *faultedValues;
 
 /** Values that have been changed but not persisted to the database.
+ 
+ Properties that have been changed to nil are represented by `NSNull`.
  */
 @property (nonatomic, readonly) NSDictionary *changedValues;
 
@@ -215,7 +286,12 @@
 /** A default ID for the object.
  
  While subclasses do not need to use this property, if they use an auto incrementing id, they should use this, as the value
- will be assigned after an insert.
+ will be assigned by the connection when the object is inserted. IDs are allocated from the largest objectID in the table, so
+ the object can be found by it's objectID before it is saved. If you set the objectID in the initialization block of
+ `insertObjectWithInitialization:`, that value is used instead.
+ 
+ If another connection to the same database file saves a row with an allocated id first, the object is given a new objectID
+ when it is saved.
  
  To not use this property in your subclasses, don't return it in `persistentKeys` or `primaryKeys`.
  */
@@ -231,4 +307,32 @@
  */
 + (instancetype)findByServerID:(NSUInteger)objectID;
 
+
+/**---------------------------------------------------------------------------------------
+ * @name Concurrency
+ *  ---------------------------------------------------------------------------------------
+ */
+
+/** Run a block that uses the object
+ 
+ Blocks for the same object are run one at a time, and can be nested. Each object has it's own lock for this, so blocks for
+ different objects only wait on each other if you nest them. Like nested dispatch_sync calls, nesting blocks for two objects in
+ opposite orders on two threads can deadlock.
+ 
+ Accessors called outside of a block only lock the object while they read or write the value, so they can run between two
+ accesses in a block. Use blocks on every thread that changes the same values to make a read and write together atomic.
+ 
+ @param block The block to run, on the current thread. It is run before this method returns.
+ */
+- (void)performBlockAndWait:(void(^)())block;
+
+/** Run a block that uses the object asynchronously
+ 
+ The block is run on a queue of the object's own, which is created the first time this is called. Blocks are run in the order
+ they were added, one at a time with any other blocks for the object.
+ 
+ @param block The block to run.
+ */
+- (void)performBlock:(void(^)())block;
+
 @end
@@ -9,21 +9,67 @@
 #import "TNKObject.h"
 
 #import <objc/runtime.h>
+#import <pthread.h>
+#import <libkern/OSAtomic.h>
 
 #import "TNKData.h"
 #import "TNKConnection_Private.h"
+#import "TNKObject_Private.h"
+#import "TNKEntityDescription.h"
+#import "TNKIdentityMap.h"
 
 
-#define TNKInObjectQueueThreadKey @"TNKInObjectQueue"
+// the alias of the rowid column when objects are read by rowid
+static NSString *const TNKRowIDColumn = @"TNKRowID";
+
+// objects share a fixed set of recursive locks instead of each having their own queue
+#define TNKObjectLockStripeCount 64
+
+// rowids are read in statements of at most this many, to stay well under SQLite's limit on the length of a statement
+#define TNKMaximumRowIDsPerQuery 500
+
+static pthread_mutex_t TNKObjectLocks[TNKObjectLockStripeCount];
+static pthread_mutexattr_t TNKRecursiveLockAttributes;
+
+
+NS_INLINE NSUInteger TNKMaskWordCount(NSUInteger count)
+{
+    return (count + 63) / 64;
+}
+
+NS_INLINE BOOL TNKMaskContainsIndex(const uint64_t *mask, NSUInteger index)
+{
+    return (mask[index / 64] & (1ULL << (index % 64))) != 0;
+}
+
+NS_INLINE void TNKMaskAddIndex(uint64_t *mask, NSUInteger index)
+{
+    mask[index / 64] |= 1ULL << (index % 64);
+}
 
 
 @interface TNKObject ()
 {
-    NSMutableDictionary *_faultedValues;
-    NSMutableDictionary *_changedValues;
-    dispatch_queue_t _propertyQueue;
+    __unsafe_unretained TNKEntityDescription *_entity;
+    
+    // one slot per persistent property, indexed by the property's index
+    TNKSlot *_slots;
+    // bitmasks of the slots that have been faulted in and changed, allocated along with _slots
+    uint64_t *_faultedMask;
+    uint64_t *_changedMask;
+    // the changes that were moved out of _changedMask when a save started, until it commits or fails
+    uint64_t *_savingMask;
+    
+    // one of TNKObjectLocks, picked by the object's address
+    pthread_mutex_t *_lock;
+    // the object's own recursive lock and queue for performBlock: and performBlockAndWait:, created the first time they are used
+    // and guarded by _lock until then
+    pthread_mutex_t *_blockLock;
+    dispatch_queue_t _blockQueue;
     
     BOOL _initializing;
+    // TNKObjectState flags, maintained by the connection
+    volatile uint32_t _state;
 }
 
 @property (nonatomic, weak, readwrite) TNKConnection *connection;
@@ -38,39 +84,108 @@
 
 #pragma mark - Properties
 
+// nil values are left out, or represented by NSNull if includeNil is set
+- (NSDictionary *)_valuesInMask:(const uint64_t *)mask includeNil:(BOOL)includeNil
+{
+    NSMutableDictionary *values = [NSMutableDictionary new];
+    for (TNKPropertyDescription *property in _entity.properties) {
+        if (!TNKMaskContainsIndex(mask, property.index)) {
+            continue;
+        }
+        
+        id value = [self _primitiveValueForProperty:property];
+        if (value != nil) {
+            values[property.name] = value;
+        } else if (includeNil) {
+            values[property.name] = [NSNull null];
+        }
+    }
+    
+    return values;
+}
+
 - (NSDictionary *)faultedValues
 {
-    __block NSDictionary *faultedValues = nil;
-    [self performBlockAndWait:^{
-        faultedValues = [_faultedValues copy];
-    }];
+    pthread_mutex_lock(_lock);
+    NSDictionary *faultedValues = [self _valuesInMask:_faultedMask includeNil:NO];
+    pthread_mutex_unlock(_lock);
     
     return faultedValues;
 }
 
 - (NSDictionary *)changedValues
 {
-    __block NSDictionary *changedValues = nil;
-    [self performBlockAndWait:^{
-        changedValues = [_changedValues copy];
-    }];
+    NSUInteger maskWordCount = TNKMaskWordCount(_entity.properties.count);
+    
+    // changes that are being saved haven't been persisted yet either
+    uint64_t mask[maskWordCount];
+    pthread_mutex_lock(_lock);
+    for (NSUInteger word = 0; word < maskWordCount; word++) {
+        mask[word] = _changedMask[word] | _savingMask[word];
+    }
+    
+    NSDictionary *changedValues = [self _valuesInMask:mask includeNil:YES];
+    pthread_mutex_unlock(_lock);
     
     return changedValues;
 }
 
 - (BOOL)isInserted
 {
-    return _initializing || [self.connection.insertedObjects containsObject:self];
+    return _initializing || (_state & TNKObjectStateInserted) != 0;
 }
 
 - (BOOL)isUpdated
 {
-    return [self.connection.updatedObjects containsObject:self];
+    return (_state & TNKObjectStateUpdated) != 0;
 }
 
 - (BOOL)isDeleted
 {
-    return [self.connection.deletedObjects containsObject:self];
+    return (_state & TNKObjectStateDeleted) != 0;
+}
+
+- (TNKObjectState)state
+{
+    return _state;
+}
+
+- (BOOL)addState:(TNKObjectState)state
+{
+    uint32_t oldState = OSAtomicOr32OrigBarrier(state, &_state);
+    
+    return (oldState & state) != state;
+}
+
+- (void)removeState:(TNKObjectState)state
+{
+    OSAtomicAnd32Barrier(~(uint32_t)state, &_state);
+}
+
+- (void)beginSavingChanges
+{
+    NSUInteger maskWordCount = TNKMaskWordCount(_entity.properties.count);
+    
+    pthread_mutex_lock(_lock);
+    for (NSUInteger word = 0; word < maskWordCount; word++) {
+        _savingMask[word] |= _changedMask[word];
+        _changedMask[word] = 0;
+    }
+    pthread_mutex_unlock(_lock);
+}
+
+- (void)finishSavingChanges:(BOOL)committed
+{
+    NSUInteger maskWordCount = TNKMaskWordCount(_entity.properties.count);
+    
+    pthread_mutex_lock(_lock);
+    for (NSUInteger word = 0; word < maskWordCount; word++) {
+        if (!committed) {
+            _changedMask[word] |= _savingMask[word];
+        }
+        _savingMask[word] = 0;
+    }
+    pthread_mutex_unlock(_lock);
 }
 
 
@@ -168,296 +283,283 @@
     return Nil;
 }
 
-+ (NSString *)_keyForSelector:(SEL)selector
-{
-    __block NSString *keyForSelector = nil;
-    [[self persistentKeys] enumerateObjectsWithOptions:NSEnumerationConcurrent usingBlock:^(NSString *key, BOOL *stop) {
-        if (selector == [self _getterForPersistentKey:key]) {
-            keyForSelector = key;
-        } else if (selector == [self _setterForPersistentKey:key]) {
-            keyForSelector = key;
-        }
-        
-        *stop = keyForSelector != nil;
-    }];
-    
-    return keyForSelector;
-}
-
 
 #pragma mark - Property Swizzling
 
-- (char)_persistentGetter_char
-{
-    return [[self primitiveValueForKey:[self.class _keyForSelector:_cmd]] charValue];
-}
-
-- (short)_persistentGetter_short
-{
-    return [[self primitiveValueForKey:[self.class _keyForSelector:_cmd]] shortValue];
-}
-
-- (int)_persistentGetter_int
-{
-    return [[self primitiveValueForKey:[self.class _keyForSelector:_cmd]] intValue];
-}
-
-- (long)_persistentGetter_long
-{
-    return [[self primitiveValueForKey:[self.class _keyForSelector:_cmd]] longValue];
-}
-
-- (long long)_persistentGetter_long_long
-{
-    return [[self primitiveValueForKey:[self.class _keyForSelector:_cmd]] longLongValue];
-}
-
-- (unsigned char)_persistentGetter_unsigned_char
-{
-    return [[self primitiveValueForKey:[self.class _keyForSelector:_cmd]] unsignedCharValue];
-}
-
-- (unsigned short)_persistentGetter_unsigned_short
-{
-    return [[self primitiveValueForKey:[self.class _keyForSelector:_cmd]] unsignedShortValue];
-}
-
-- (unsigned int)_persistentGetter_unsigned_int
-{
-    return [[self primitiveValueForKey:[self.class _keyForSelector:_cmd]] unsignedIntValue];
-}
-
-- (unsigned long)_persistentGetter_unsigned_long
-{
-    return [[self primitiveValueForKey:[self.class _keyForSelector:_cmd]] unsignedLongValue];
-}
-
-- (unsigned long long)_persistentGetter_unsigned_long_long
-{
-    return [[self primitiveValueForKey:[self.class _keyForSelector:_cmd]] unsignedLongLongValue];
-}
-
-- (bool)_persistentGetter_bool
-{
-    return [[self primitiveValueForKey:[self.class _keyForSelector:_cmd]] boolValue];
-}
-
-- (float)_persistentGetter_float
-{
-    return [[self primitiveValueForKey:[self.class _keyForSelector:_cmd]] floatValue];
-}
-
-- (double)_persistentGetter_double
-{
-    return [[self primitiveValueForKey:[self.class _keyForSelector:_cmd]] doubleValue];
-}
-
-- (id)_persistentGetter_id
-{
-    return [self primitiveValueForKey:[self.class _keyForSelector:_cmd]];
-}
-
-+ (SEL)_primativeGetterForKey:(NSString *)key
-{
-    NSString *type = [self _typeForPersistentKey:key];
+static char TNKAccessorsInstalledKey;
+
+#define TNKScalarAccessorBlocks(type, slotMember) \
+    getter = imp_implementationWithBlock(^type(TNKObject *object) { \
+        pthread_mutex_lock(object->_lock); \
+        type value = (type)object->_slots[index].slotMember; \
+        pthread_mutex_unlock(object->_lock); \
+        return value; \
+    }); \
+    setter = imp_implementationWithBlock(^(TNKObject *object, type value) { \
+        pthread_mutex_lock(object->_lock); \
+        if (!TNKMaskContainsIndex(object->_faultedMask, index) || object->_slots[index].slotMember != value) { \
+            object->_slots[index].slotMember = value; \
+            [object _didChangePropertyAtIndex:index]; \
+        } \
+        pthread_mutex_unlock(object->_lock); \
+    });
+
++ (void)_installAccessorsForProperty:(TNKPropertyDescription *)property
+{
+    NSUInteger index = property.index;
+    IMP getter = NULL;
+    IMP setter = NULL;
     
-    switch ([type characterAtIndex:0]) {
+    switch (property.typeEncoding) {
         case 'c':
-            return @selector(_persistentGetter_char);
+            TNKScalarAccessorBlocks(char, integerValue);
+            break;
         case 's':
-            return @selector(_persistentGetter_short);
+            TNKScalarAccessorBlocks(short, integerValue);
+            break;
         case 'i':
-            return @selector(_persistentGetter_int);
+            TNKScalarAccessorBlocks(int, integerValue);
+            break;
         case 'l':
-            return @selector(_persistentGetter_long);
+            TNKScalarAccessorBlocks(long, integerValue);
+            break;
         case 'q':
-            return @selector(_persistentGetter_long_long);
+            TNKScalarAccessorBlocks(long long, integerValue);
+            break;
         case 'C':
-            return @selector(_persistentGetter_unsigned_char);
-        case 'I':
-            return @selector(_persistentGetter_unsigned_int);
+            TNKScalarAccessorBlocks(unsigned char, unsignedIntegerValue);
+            break;
         case 'S':
-            return @selector(_persistentGetter_unsigned_short);
+            TNKScalarAccessorBlocks(unsigned short, unsignedIntegerValue);
+            break;
+        case 'I':
+            TNKScalarAccessorBlocks(unsigned int, unsignedIntegerValue);
+            break;
         case 'L':
-            return @selector(_persistentGetter_unsigned_long);
+            TNKScalarAccessorBlocks(unsigned long, unsignedIntegerValue);
+            break;
         case 'Q':
-            return @selector(_persistentGetter_unsigned_long_long);
+            TNKScalarAccessorBlocks(unsigned long long, unsignedIntegerValue);
+            break;
         case 'B':
-            return @selector(_persistentGetter_bool);
+            TNKScalarAccessorBlocks(bool, integerValue);
+            break;
         case 'f':
-            return @selector(_persistentGetter_float);
+            TNKScalarAccessorBlocks(float, doubleValue);
+            break;
         case 'd':
-            return @selector(_persistentGetter_double);
+            TNKScalarAccessorBlocks(double, doubleValue);
+            break;
         default:
-            return @selector(_persistentGetter_id);
+            getter = imp_implementationWithBlock(^id(TNKObject *object) {
+                pthread_mutex_lock(object->_lock);
+                id value = (__bridge id)object->_slots[index].objectValue;
+                pthread_mutex_unlock(object->_lock);
+                return value;
+            });
+            setter = imp_implementationWithBlock(^(TNKObject *object, id value) {
+                pthread_mutex_lock(object->_lock);
+                if (![object _hasPrimitiveValue:value forProperty:property]) {
+                    [object _setPrimitiveValue:value forProperty:property];
+                    [object _didChangePropertyAtIndex:index];
+                }
+                pthread_mutex_unlock(object->_lock);
+            });
+            break;
+    }
+    
+    char typeEncoding = property.typeEncoding;
+    if (strchr("csilqCSILQBfd", typeEncoding) == NULL) {
+        typeEncoding = '@';
+    }
+    
+    [self _addAccessor:getter forSelector:property.getter types:[NSString stringWithFormat:@"%c@:", typeEncoding]];
+    if (!property.isReadonly) {
+        [self _addAccessor:setter forSelector:property.setter types:[NSString stringWithFormat:@"v@:%c", typeEncoding]];
+    } else {
+        imp_removeBlock(setter);
     }
 }
 
-- (void)_persistentSetter_char:(char)value
-{
-    [self setPrimativeValue:@(value) forKey:[self.class _keyForSelector:_cmd]];
-}
-
-- (void)_persistentSetter_short:(short)value
-{
-    [self setPrimativeValue:@(value) forKey:[self.class _keyForSelector:_cmd]];
-}
-
-- (void)_persistentSetter_int:(int)value
-{
-    [self setPrimativeValue:@(value) forKey:[self.class _keyForSelector:_cmd]];
-}
-
-- (void)_persistentSetter_long:(long)value
-{
-    [self setPrimativeValue:@(value) forKey:[self.class _keyForSelector:_cmd]];
-}
-
-- (void)_persistentSetter_long_long:(long long)value
-{
-    [self setPrimativeValue:@(value) forKey:[self.class _keyForSelector:_cmd]];
-}
-
-- (void)_persistentSetter_unsigned_char:(unsigned char)value
++ (void)_addAccessor:(IMP)implementation forSelector:(SEL)selector types:(NSString *)types
 {
-    [self setPrimativeValue:@(value) forKey:[self.class _keyForSelector:_cmd]];
+    // don't replace accessors that were implemented by hand, but do replace accessors that we installed on a superclass, since
+    // those were generated for a different entity
+    Method existing = selector != NULL ? class_getInstanceMethod(self, selector) : NULL;
+    if (existing == NULL || imp_getBlock(method_getImplementation(existing)) != nil) {
+        if (class_addMethod(self, selector, implementation, types.UTF8String)) {
+            return;
+        }
+    }
+    
+    imp_removeBlock(implementation);
 }
 
-- (void)_persistentSetter_unsigned_short:(unsigned short)value
++ (void)installPersistentAccessors
 {
-    [self setPrimativeValue:@(value) forKey:[self.class _keyForSelector:_cmd]];
+    @synchronized(self) {
+        if (objc_getAssociatedObject(self, &TNKAccessorsInstalledKey) != nil) {
+            return;
+        }
+        
+        // set before installing, because looking up existing methods can end up back in resolveInstanceMethod:
+        objc_setAssociatedObject(self, &TNKAccessorsInstalledKey, @YES, OBJC_ASSOCIATION_RETAIN);
+        
+        for (TNKPropertyDescription *property in [self entityDescription].properties) {
+            [self _installAccessorsForProperty:property];
+        }
+    }
 }
 
-- (void)_persistentSetter_unsigned_int:(unsigned int)value
++ (BOOL)resolveInstanceMethod:(SEL)selector
 {
-    [self setPrimativeValue:@(value) forKey:[self.class _keyForSelector:_cmd]];
+    // classes registered with a connection already have their accessors, this only catches classes that are used without one
+    if (objc_getAssociatedObject(self, &TNKAccessorsInstalledKey) == nil && [[self entityDescription] propertyForSelector:selector] != nil) {
+        [self installPersistentAccessors];
+        
+        return class_getInstanceMethod(self, selector) != NULL;
+    }
+    
+    return [super resolveInstanceMethod:selector];
 }
 
-- (void)_persistentSetter_unsigned_long:(unsigned long)value
-{
-    [self setPrimativeValue:@(value) forKey:[self.class _keyForSelector:_cmd]];
-}
 
-- (void)_persistentSetter_unsigned_long_long:(unsigned long long)value
-{
-    [self setPrimativeValue:@(value) forKey:[self.class _keyForSelector:_cmd]];
-}
+#pragma mark - Persistent Key Management
 
-- (void)_persistentSetter_bool:(bool)value
++ (TNKEntityDescription *)entityDescription
 {
-    [self setPrimativeValue:@(value) forKey:[self.class _keyForSelector:_cmd]];
+    return [TNKEntityDescription entityForClass:self];
 }
 
-- (void)_persistentSetter_float:(float)value
++ (NSSet *)persistentKeys
 {
-    [self setPrimativeValue:@(value) forKey:[self.class _keyForSelector:_cmd]];
+    return [NSSet setWithObject:@"objectID"];
 }
 
-- (void)_persistentSetter_double:(double)value
++ (NSSet *)primaryKeys
 {
-    [self setPrimativeValue:@(value) forKey:[self.class _keyForSelector:_cmd]];
+    return [NSSet setWithObject:@"objectID"];
 }
 
-- (void)_persistentSetter_id:(id)value
+// must be called while holding the object's lock
+- (id)_primitiveValueForProperty:(TNKPropertyDescription *)property
 {
-    [self setPrimativeValue:value forKey:[self.class _keyForSelector:_cmd]];
+    if (!TNKMaskContainsIndex(_faultedMask, property.index)) {
+        return nil;
+    }
+    
+    TNKSlot slot = _slots[property.index];
+    switch (property.storage) {
+        case TNKPropertyStorageObject:
+            return (__bridge id)slot.objectValue;
+        case TNKPropertyStorageInteger:
+            return property.typeEncoding == 'B' ? @((bool)slot.integerValue) : @(slot.integerValue);
+        case TNKPropertyStorageUnsignedInteger:
+            return @(slot.unsignedIntegerValue);
+        case TNKPropertyStorageDouble:
+            return @(slot.doubleValue);
+    }
 }
 
-+ (SEL)_primativeSetterForKey:(NSString *)key
+// Must be called while holding the object's lock. Setting a value that is already faulted in doesn't need to be saved. Values that
+// haven't been faulted in are never equal, since we don't know what is in the database.
+- (BOOL)_hasPrimitiveValue:(id)value forProperty:(TNKPropertyDescription *)property
 {
-    NSString *type = [self _typeForPersistentKey:key];
+    if (!TNKMaskContainsIndex(_faultedMask, property.index)) {
+        return NO;
+    }
     
-    switch ([type characterAtIndex:0]) {
-        case 'c':
-            return @selector(_persistentSetter_char:);
-        case 's':
-            return @selector(_persistentSetter_short:);
-        case 'i':
-            return @selector(_persistentSetter_int:);
-        case 'l':
-            return @selector(_persistentSetter_long:);
-        case 'q':
-            return @selector(_persistentSetter_long_long:);
-        case 'C':
-            return @selector(_persistentSetter_unsigned_char:);
-        case 'I':
-            return @selector(_persistentSetter_unsigned_int:);
-        case 'S':
-            return @selector(_persistentSetter_unsigned_short:);
-        case 'L':
-            return @selector(_persistentSetter_unsigned_long:);
-        case 'Q':
-            return @selector(_persistentSetter_unsigned_long_long:);
-        case 'B':
-            return @selector(_persistentSetter_bool:);
-        case 'f':
-            return @selector(_persistentSetter_float:);
-        case 'd':
-            return @selector(_persistentSetter_double:);
-        default:
-            return @selector(_persistentSetter_id:);
+    if (value == [NSNull null]) {
+        value = nil;
     }
+    
+    id currentValue = [self _primitiveValueForProperty:property];
+    return currentValue == value || [currentValue isEqual:value];
 }
 
-+ (BOOL)resolveInstanceMethod:(SEL)selector
+// must be called while holding the object's lock, and does not mark the value as changed
+- (void)_setPrimitiveValue:(id)value forProperty:(TNKPropertyDescription *)property
 {
-    NSString *key = [self _keyForSelector:selector];
-    if (key != nil) {
-        if (selector == [self _getterForPersistentKey:key]) {
-            Method method = class_getInstanceMethod(self, [self _primativeGetterForKey:key]);
-            return class_addMethod(self, selector, method_getImplementation(method), method_getTypeEncoding(method));
-        } else {
-            Method method = class_getInstanceMethod(self, [self _primativeSetterForKey:key]);
-            return class_addMethod(self, selector, method_getImplementation(method), method_getTypeEncoding(method));
+    if (value == [NSNull null]) {
+        value = nil;
+    }
+    
+    TNKSlot *slot = &_slots[property.index];
+    switch (property.storage) {
+        case TNKPropertyStorageObject: {
+            void *oldValue = slot->objectValue;
+            slot->objectValue = (void *)CFBridgingRetain([value copy]);
+            if (oldValue != NULL) {
+                CFRelease(oldValue);
+            }
+            break;
+        } case TNKPropertyStorageInteger: {
+            slot->integerValue = [value longLongValue];
+            break;
+        } case TNKPropertyStorageUnsignedInteger: {
+            slot->unsignedIntegerValue = [value unsignedLongLongValue];
+            break;
+        } case TNKPropertyStorageDouble: {
+            slot->doubleValue = [value doubleValue];
+            break;
         }
     }
     
-    return [super resolveInstanceMethod:selector];
-}
-
-
-#pragma mark - Persistent Key Management
-
-+ (NSSet *)persistentKeys
-{
-    return [NSSet setWithObject:@"objectID"];
+    TNKMaskAddIndex(_faultedMask, property.index);
 }
 
-+ (NSSet *)primaryKeys
+// must be called while holding the object's lock
+- (void)_didChangePropertyAtIndex:(NSUInteger)index
 {
-    return [NSSet setWithObject:@"objectID"];
+    TNKMaskAddIndex(_faultedMask, index);
+    TNKMaskAddIndex(_changedMask, index);
+    
+    if (!_initializing && (_state & (TNKObjectStateInserted | TNKObjectStateUpdated | TNKObjectStateDeleted)) == 0) {
+        [self.connection updateObject:self];
+    }
 }
 
 - (id)primitiveValueForKey:(NSString *)key
 {
-    __block id value = nil;
-    [self performBlockAndWait:^{
-        value = _faultedValues[key];
-    }];
+    TNKPropertyDescription *property = [_entity propertyForKey:key];
+    if (property == nil) {
+        return nil;
+    }
+    
+    pthread_mutex_lock(_lock);
+    id value = [self _primitiveValueForProperty:property];
+    pthread_mutex_unlock(_lock);
     
     return value;
 }
 
 - (void)setPrimativeValue:(id)value forKey:(NSString *)key
 {
-    value = [value copy];
-    [self performBlock:^{
-        _faultedValues[key] = value;
-        _changedValues[key] = value;
-        if (!self.isInserted && !self.isUpdated && !self.isDeleted) {
-            [self.connection updateObject:self];
-        }
-    }];
+    TNKPropertyDescription *property = [_entity propertyForKey:key];
+    if (property == nil) {
+        return;
+    }
+    
+    pthread_mutex_lock(_lock);
+    if (![self _hasPrimitiveValue:value forProperty:property]) {
+        [self _setPrimitiveValue:value forProperty:property];
+        [self _didChangePropertyAtIndex:property.index];
+    }
+    pthread_mutex_unlock(_lock);
 }
 
 - (id)valueForUndefinedKey:(NSString *)key
 {
-    return [self primitiveValueForKey:key] ?: [super valueForUndefinedKey:key];
+    if ([_entity propertyForKey:key] != nil) {
+        return [self primitiveValueForKey:key];
+    }
+    
+    return [super valueForUndefinedKey:key];
 }
 
 - (void)setValue:(id)value forUndefinedKey:(NSString *)key
 {
-    if ([[self.class persistentKeys] containsObject:key]) {
+    if ([_entity propertyForKey:key] != nil) {
         [self setPrimativeValue:value forKey:key];
     } else {
         [super setValue:value forUndefinedKey:key];
@@ -528,10 +630,10 @@
 
 - (NSString *)sqliteWhereClause
 {
-    NSSet *primaryKeys = [self.class primaryKeys];
-    NSMutableArray *keyClauses = [[NSMutableArray alloc] initWithCapacity:primaryKeys.count];
-    for (NSString *key in primaryKeys) {
-        [keyClauses addObject:[NSString stringWithFormat:@"%1$@ = :%1$@", key]];
+    NSArray *primaryKeyProperties = [self.class entityDescription].primaryKeyProperties;
+    NSMutableArray *keyClauses = [[NSMutableArray alloc] initWithCapacity:primaryKeyProperties.count];
+    for (TNKPropertyDescription *property in primaryKeyProperties) {
+        [keyClauses addObject:[NSString stringWithFormat:@"%1$@ = :%1$@", property.name]];
     }
     
     return [keyClauses componentsJoinedByString:@" AND "];
@@ -539,131 +641,853 @@
 
 + (void)createTableInDatabase:(FMDatabase *)db
 {
-    NSSet *persistentKeys = [self persistentKeys];
+    TNKEntityDescription *entity = [self entityDescription];
     NSMutableArray *columnDefinitions = [NSMutableArray new];
-    for (NSString *key in persistentKeys) {
-        NSString *type = [self sqliteTypeForPersistentKey:key] ?: @"";
-        NSString *columnConstraints = [self sqliteColumnConstraintsForPersistentKey:key] ?: @"";
+    for (TNKPropertyDescription *property in entity.properties) {
+        NSString *type = property.sqliteType ?: @"";
+        NSString *columnConstraints = [self sqliteColumnConstraintsForPersistentKey:property.name] ?: @"";
         
-        [columnDefinitions addObject:[NSString stringWithFormat:@"%@ %@ %@", key, type, columnConstraints]];
+        [columnDefinitions addObject:[NSString stringWithFormat:@"%@ %@ %@", property.name, type, columnConstraints]];
     }
     
-    NSString *sql = [NSString stringWithFormat:@"CREATE TABLE IF NOT EXISTS %@ (%@)", [self sqliteTableName], [columnDefinitions componentsJoinedByString:@", "]];
+    NSString *sql = [NSString stringWithFormat:@"CREATE TABLE IF NOT EXISTS %@ (%@)", entity.tableName, [columnDefinitions componentsJoinedByString:@", "]];
     NSLog(@"create table sql: %@", sql);
     [db executeUpdate:sql];
 }
 
 - (void)insertIntoDatabase:(FMDatabase *)db
 {
-    NSDictionary *values = [self.changedValues copy];
-    NSArray *keys = [values allKeys];
-    NSMutableArray *keyPlaceholder = [[NSMutableArray alloc] initWithCapacity:keys.count];
-    for (NSString *key in keys) {
-        [keyPlaceholder addObject:[@":" stringByAppendingString:key]];
-    }
-    
-    NSString *query = [NSString stringWithFormat:@"INSERT INTO %@ (%@) VALUES (%@)", [self.class sqliteTableName], [keys componentsJoinedByString:@", "], [keyPlaceholder componentsJoinedByString:@", "]];
-    NSLog(@"insert query: %@", query);
-    
-    [db executeUpdate:query withParameterDictionary:values];
-    
-    [self performBlockAndWait:^{
-        _faultedValues[@"objectID"] = @([db lastInsertRowId]);
-    }];
+    [self.class _insertObjects:@[ self ] intoDatabase:db];
 }
 
 - (void)updateInDatabase:(FMDatabase *)db
 {
-    NSMutableDictionary *values = [self.changedValues mutableCopy];
-    NSArray *keys = [values allKeys];
-    NSMutableArray *keyClauses = [[NSMutableArray alloc] initWithCapacity:keys.count];
-    for (NSString *key in keys) {
-        [keyClauses addObject:[NSString stringWithFormat:@"%1$@ = :%1$@", key]];
+    [self.class _updateObjects:@[ self ] inDatabase:db];
+}
+
+- (void)deleteFromDatabase:(FMDatabase *)db
+{
+    [self.class _deleteObjects:@[ self ] fromDatabase:db];
+}
+
++ (BOOL)insertObjects:(NSArray *)objects intoDatabase:(FMDatabase *)db
+{
+    if ([self _overridesInstanceMethod:@selector(insertIntoDatabase:)]) {
+        for (TNKObject *object in objects) {
+            [object insertIntoDatabase:db];
+        }
+        
+        return ![db hadError];
     }
     
-    for (NSString *key in [self.class primaryKeys]) {
-        values[key] = [self valueForKey:key];
+    return [self _insertObjects:objects intoDatabase:db];
+}
+
++ (BOOL)updateObjects:(NSArray *)objects inDatabase:(FMDatabase *)db
+{
+    if ([self _overridesInstanceMethod:@selector(updateInDatabase:)]) {
+        for (TNKObject *object in objects) {
+            [object updateInDatabase:db];
+        }
+        
+        return ![db hadError];
     }
     
-    NSString *query = [NSString stringWithFormat:@"UPDATE %@ SET %@ WHERE %@", [self.class sqliteTableName], [keyClauses componentsJoinedByString:@", "], [self sqliteWhereClause]];
-    NSLog(@"update query: %@", query);
-    
-    [db executeUpdate:query withParameterDictionary:values];
+    return [self _updateObjects:objects inDatabase:db];
 }
 
-- (void)deleteFromDatabase:(FMDatabase *)db
++ (BOOL)deleteObjects:(NSArray *)objects fromDatabase:(FMDatabase *)db
 {
-    NSMutableDictionary *values = [[NSMutableDictionary alloc] initWithCapacity:[self.class primaryKeys].count];
-    for (NSString *key in [self.class primaryKeys]) {
-        values[key] = [self valueForKey:key];
+    if ([self _overridesInstanceMethod:@selector(deleteFromDatabase:)]) {
+        for (TNKObject *object in objects) {
+            [object deleteFromDatabase:db];
+        }
+        
+        return ![db hadError];
     }
     
-    NSString *query = [NSString stringWithFormat:@"DELETE FROM %@ WHERE %@", [self.class sqliteTableName], [self sqliteWhereClause]];
-    NSLog(@"delete query: %@", query);
-    
-    [db executeUpdate:query withParameterDictionary:values];
+    return [self _deleteObjects:objects fromDatabase:db];
 }
 
-+ (NSArray *)executeQuery:(TNKObjectQuery *)objectQuery inDatabase:(FMDatabase *)db
+// Reads a value from the current row of a result set in the storage of the property. Object values are retained. Returns NO if
+// the value couldn't be converted to the class of the property.
+static BOOL TNKSlotFromResultSet(TNKSlot *slot, TNKPropertyDescription *property, FMResultSet *resultSet, int column)
 {
-    NSString *whereClause = [objectQuery.predicate sqliteWhereClause];
-    NSArray *arguments = [objectQuery.predicate sqliteWhereClauseArguments];
-    NSString *query = [NSString stringWithFormat:@"SELECT %@ FROM %@ WHERE %@", [[objectQuery.keysToFetch allObjects] componentsJoinedByString:@", "], [self.class sqliteTableName], whereClause];
-    NSLog(@"select query: %@, [%@]", query, [arguments componentsJoinedByString:@", "]);
+    if ([resultSet columnIndexIsNull:column]) {
+        slot->unsignedIntegerValue = 0;
+        slot->objectValue = NULL;
+        return YES;
+    }
     
-    FMResultSet *resultSet = [db executeQuery:query withArgumentsInArray:arguments];
-    NSMutableArray *objects = [NSMutableArray new];
-    while ([resultSet next]) {
-        TNKObject *object = [[self alloc] init];
-        object.connection = [TNKConnection currentConnection];
-        
-        NSDictionary *resultDictionary = resultSet.resultDictionary;
-        NSMutableDictionary *faultedValues = [[NSMutableDictionary alloc] initWithCapacity:resultDictionary.count];
-        [resultDictionary enumerateKeysAndObjectsUsingBlock:^(id key, id obj, BOOL *stop) {
-            Class class = [self _classForPersistentKey:key];
+    switch (property.storage) {
+        case TNKPropertyStorageInteger: {
+            slot->integerValue = [resultSet longLongIntForColumnIndex:column];
+            return YES;
+        } case TNKPropertyStorageUnsignedInteger: {
+            slot->unsignedIntegerValue = [resultSet unsignedLongLongIntForColumnIndex:column];
+            return YES;
+        } case TNKPropertyStorageDouble: {
+            slot->doubleValue = [resultSet doubleForColumnIndex:column];
+            return YES;
+        } case TNKPropertyStorageObject: {
+            Class class = property.valueClass;
+            id obj = [resultSet objectForColumnIndex:column];
+            
             if ([class isSubclassOfClass:[NSDate class]] && [obj respondsToSelector:@selector(doubleValue)]) {
-                faultedValues[key] = [class dateWithTimeIntervalSince1970:[obj doubleValue]];
+                obj = [class dateWithTimeIntervalSince1970:[obj doubleValue]];
             } else if ([class isSubclassOfClass:[NSString class]] && ![obj isKindOfClass:class]) {
-                faultedValues[key] = [class stringWithString:[obj description]];
+                obj = [class stringWithString:[obj description]];
             } else if ([class isSubclassOfClass:[NSNumber class]] && ![obj isKindOfClass:class] && [obj respondsToSelector:@selector(doubleValue)]) {
-                faultedValues[key] = [class numberWithDouble:[obj doubleValue]];
-            } else if ([obj isKindOfClass:class]) {
-                faultedValues[key] = obj;
-            } else {
-                NSLog(@"Warning, ignoring object because it is not able to be converted to the correct type: obj=%@, key=%@, expected class=%@", obj, key, NSStringFromClass(class));
+                obj = [class numberWithDouble:[obj doubleValue]];
+            } else if (class != Nil && ![obj isKindOfClass:class]) {
+                NSLog(@"Warning, ignoring object because it is not able to be converted to the correct type: obj=%@, key=%@, expected class=%@", obj, property.name, NSStringFromClass(class));
+                slot->objectValue = NULL;
+                return NO;
             }
-        }];
-        object->_faultedValues = faultedValues;
-        [object.connection registerObject:object];
-        
-        [objects addObject:object];
+            
+            slot->objectValue = (void *)CFBridgingRetain(obj);
+            return YES;
+        }
     }
-    
-    return objects;
 }
 
-
-#pragma mark - Insertion
-
-- (instancetype)init
+// builds a SELECT with the filtering, sorting and paging of a query
++ (NSString *)_selectQueryWithColumns:(NSString *)columns forObjectQuery:(TNKObjectQuery *)objectQuery
 {
-    self = [super init];
-    if (self) {
-        _propertyQueue = dispatch_queue_create("TNKObject_property", NULL);
-        
-        _faultedValues = [NSMutableDictionary new];
-        _changedValues = [NSMutableDictionary new];
+    NSMutableString *query = [[NSMutableString alloc] initWithFormat:@"SELECT %@%@ FROM %@", objectQuery.returnsDistinctResults ? @"DISTINCT " : @"", columns, [self entityDescription].tableName];
+    
+    if (objectQuery.predicate != nil) {
+        [query appendFormat:@" WHERE %@", [objectQuery.predicate sqliteWhereClause]];
     }
     
-    return self;
+    if (objectQuery.sortDescriptors.count > 0) {
+        [query appendFormat:@" ORDER BY %@", [[objectQuery.sortDescriptors valueForKey:@"sqliteOrderClause"] componentsJoinedByString:@", "]];
+    }
+    
+    // an OFFSET needs a LIMIT, and a negative limit means there isn't one
+    if (objectQuery.limit > 0 || objectQuery.offset > 0) {
+        [query appendFormat:@" LIMIT %lld", objectQuery.limit > 0 ? (long long)objectQuery.limit : -1LL];
+    }
+    if (objectQuery.offset > 0) {
+        [query appendFormat:@" OFFSET %llu", (unsigned long long)objectQuery.offset];
+    }
+    
+    return query;
 }
 
-+ (instancetype)find:(NSDictionary *)values
++ (NSArray *)executeQuery:(TNKObjectQuery *)objectQuery inDatabase:(FMDatabase *)db
 {
-    return [self find:values usingQuery:nil];
-}
-
-+ (instancetype)find:(NSDictionary *)values usingQuery:(void(^)(TNKObjectQuery *query))queryBlock
+    NSMutableArray *objects = [NSMutableArray new];
+    [self _enumerateQuery:objectQuery inDatabase:db batchSize:NSUIntegerMax usingBlock:^(NSArray *batch, BOOL *stop) {
+        [objects addObjectsFromArray:batch];
+    }];
+    
+    return objects;
+}
+
++ (void)enumerateQuery:(TNKObjectQuery *)objectQuery inDatabase:(FMDatabase *)db batchSize:(NSUInteger)batchSize usingBlock:(void(^)(NSArray *objects, BOOL *stop))block
+{
+    // subclasses that customize how objects are queried get all of their results at once
+    if ([self methodForSelector:@selector(executeQuery:inDatabase:)] != [TNKObject methodForSelector:@selector(executeQuery:inDatabase:)]) {
+        BOOL stop = NO;
+        block([self executeQuery:objectQuery inDatabase:db], &stop);
+        return;
+    }
+    
+    [self _enumerateQuery:objectQuery inDatabase:db batchSize:batchSize usingBlock:block];
+}
+
++ (void)_enumerateQuery:(TNKObjectQuery *)objectQuery inDatabase:(FMDatabase *)db batchSize:(NSUInteger)batchSize usingBlock:(void(^)(NSArray *objects, BOOL *stop))block
+{
+    NSArray *arguments = [objectQuery.predicate sqliteWhereClauseArguments] ?: @[];
+    NSString *query = [self _selectQueryWithColumns:[[objectQuery.keysToFetch allObjects] componentsJoinedByString:@", "] forObjectQuery:objectQuery];
+    NSLog(@"select query: %@, [%@]", query, [arguments componentsJoinedByString:@", "]);
+    
+    FMResultSet *resultSet = [db executeQuery:query withArgumentsInArray:arguments];
+    [self _enumerateResultSet:resultSet batchSize:batchSize usingBlock:^(NSArray *objects, const int64_t *rowIDs, BOOL *stop) {
+        block(objects, stop);
+    }];
+    [resultSet close];
+}
+
+// Reads objects from a result set a batch at a time. If the result set has a TNKRowIDColumn column, the rowid of each object is
+// passed to the block as well, otherwise rowIDs is NULL.
++ (void)_enumerateResultSet:(FMResultSet *)resultSet batchSize:(NSUInteger)batchSize usingBlock:(void(^)(NSArray *objects, const int64_t *rowIDs, BOOL *stop))block
+{
+    TNKEntityDescription *entity = [self entityDescription];
+    
+    // map each column to it's property once, instead of once per row
+    int columnCount = [resultSet columnCount];
+    int rowIDColumn = -1;
+    NSMutableArray *columnProperties = [[NSMutableArray alloc] initWithCapacity:columnCount];
+    for (int column = 0; column < columnCount; column++) {
+        NSString *columnName = [resultSet columnNameForIndex:column];
+        if ([columnName isEqualToString:TNKRowIDColumn]) {
+            rowIDColumn = column;
+        }
+        
+        [columnProperties addObject:[entity propertyForKey:columnName] ?: [NSNull null]];
+    }
+    
+    TNKConnection *connection = [TNKConnection currentConnection];
+    TNKIdentityMap *identityMap = [connection identityMapForClass:self];
+    
+    // rows can only be matched to registered objects if all of the primary keys were fetched
+    NSArray *primaryKeyProperties = entity.primaryKeyProperties;
+    NSUInteger primaryKeyCount = primaryKeyProperties.count;
+    int primaryKeyColumns[MAX(primaryKeyCount, 1)];
+    BOOL fetchedPrimaryKeys = identityMap != nil && primaryKeyCount > 0;
+    for (NSUInteger index = 0; index < primaryKeyCount; index++) {
+        NSUInteger column = [columnProperties indexOfObjectIdenticalTo:primaryKeyProperties[index]];
+        fetchedPrimaryKeys = fetchedPrimaryKeys && column != NSNotFound;
+        primaryKeyColumns[index] = (int)column;
+    }
+    TNKSlot primaryKeyValues[MAX(primaryKeyCount, 1)];
+    
+    BOOL hasRows = YES;
+    BOOL stop = NO;
+    while (hasRows && !stop) {
+        // objects that the block doesn't keep are released after each batch
+        @autoreleasepool {
+            NSMutableArray *objects = [NSMutableArray new];
+            NSMutableData *rowIDs = rowIDColumn != -1 ? [NSMutableData new] : nil;
+            // new objects are registered together after the batch has been read
+            NSMutableArray *newObjects = [NSMutableArray new];
+            NSMutableIndexSet *newObjectIndexes = [NSMutableIndexSet new];
+            while (objects.count < batchSize && (hasRows = [resultSet next])) {
+                TNKObject *object = nil;
+                
+                if (fetchedPrimaryKeys) {
+                    BOOL validKey = YES;
+                    for (NSUInteger index = 0; index < primaryKeyCount; index++) {
+                        primaryKeyValues[index].objectValue = NULL;
+                        validKey = TNKSlotFromResultSet(&primaryKeyValues[index], primaryKeyProperties[index], resultSet, primaryKeyColumns[index]) && validKey;
+                    }
+                    
+                    if (validKey) {
+                        object = [identityMap objectForPrimaryKeyValues:primaryKeyValues];
+                    }
+                    [identityMap releasePrimaryKeyValues:primaryKeyValues];
+                }
+                
+                if (object != nil) {
+                    // the object is already in memory, so only fill in the values it doesn't have yet, to avoid overwriting unsaved
+                    // changes
+                    pthread_mutex_lock(object->_lock);
+                    for (int column = 0; column < columnCount; column++) {
+                        TNKPropertyDescription *property = columnProperties[column];
+                        if ((id)property != [NSNull null] && !TNKMaskContainsIndex(object->_faultedMask, property.index)) {
+                            [object _setFaultedValueForProperty:property fromResultSet:resultSet columnIndex:column];
+                        }
+                    }
+                    pthread_mutex_unlock(object->_lock);
+                } else {
+                    object = [[self alloc] init];
+                    object.connection = connection;
+                    
+                    for (int column = 0; column < columnCount; column++) {
+                        TNKPropertyDescription *property = columnProperties[column];
+                        if ((id)property != [NSNull null]) {
+                            [object _setFaultedValueForProperty:property fromResultSet:resultSet columnIndex:column];
+                        }
+                    }
+                    
+                    [newObjects addObject:object];
+                    [newObjectIndexes addIndex:objects.count];
+                }
+                
+                [objects addObject:object];
+                
+                if (rowIDs != nil) {
+                    int64_t rowID = [resultSet longLongIntForColumnIndex:rowIDColumn];
+                    [rowIDs appendBytes:&rowID length:sizeof(rowID)];
+                }
+            }
+            
+            // another thread may have registered the same rows while we were reading them. Objects without their primary keys can't
+            // be registered at all.
+            if (fetchedPrimaryKeys && newObjects.count > 0) {
+                [objects replaceObjectsAtIndexes:newObjectIndexes withObjects:[identityMap registerObjects:newObjects]];
+            }
+            
+            if (objects.count > 0) {
+                block(objects, rowIDs.bytes, &stop);
+            }
+        }
+    }
+}
+
++ (NSData *)rowIDsForQuery:(TNKObjectQuery *)objectQuery inDatabase:(FMDatabase *)db
+{
+    NSArray *arguments = [objectQuery.predicate sqliteWhereClauseArguments] ?: @[];
+    NSString *query = [self _selectQueryWithColumns:@"rowid" forObjectQuery:objectQuery];
+    
+    NSMutableData *rowIDs = [NSMutableData new];
+    FMResultSet *resultSet = [db executeQuery:query withArgumentsInArray:arguments];
+    while ([resultSet next]) {
+        int64_t rowID = [resultSet longLongIntForColumnIndex:0];
+        [rowIDs appendBytes:&rowID length:sizeof(rowID)];
+    }
+    [resultSet close];
+    
+    return rowIDs;
+}
+
++ (NSArray *)objectsWithRowIDs:(const int64_t *)rowIDs count:(NSUInteger)count keysToFetch:(NSSet *)keysToFetch inDatabase:(FMDatabase *)db
+{
+    // SQLite names the rowid after an INTEGER PRIMARY KEY if there is one, so it needs an alias of it's own
+    NSMutableArray *columns = [[NSMutableArray alloc] initWithObjects:[NSString stringWithFormat:@"rowid AS %@", TNKRowIDColumn], nil];
+    [columns addObjectsFromArray:[keysToFetch allObjects]];
+    NSString *columnList = [columns componentsJoinedByString:@", "];
+    NSString *tableName = [self entityDescription].tableName;
+    
+    NSMutableDictionary *objectsByRowID = [[NSMutableDictionary alloc] initWithCapacity:count];
+    for (NSUInteger start = 0; start < count; start += TNKMaximumRowIDsPerQuery) {
+        NSUInteger length = MIN(count - start, TNKMaximumRowIDsPerQuery);
+        
+        // the rowids are our own integers, so they are written into the statement instead of bound, which would be limited to 999
+        NSMutableArray *rowIDStrings = [[NSMutableArray alloc] initWithCapacity:length];
+        for (NSUInteger index = start; index < start + length; index++) {
+            [rowIDStrings addObject:[NSString stringWithFormat:@"%lld", (long long)rowIDs[index]]];
+        }
+        
+        NSString *query = [NSString stringWithFormat:@"SELECT %@ FROM %@ WHERE rowid IN (%@)", columnList, tableName, [rowIDStrings componentsJoinedByString:@", "]];
+        FMResultSet *resultSet = [db executeQuery:query];
+        if (resultSet == nil) {
+            NSLog(@"Warning, could not read %@ objects by rowid: %@", self, [db lastErrorMessage]);
+            return nil;
+        }
+        
+        [self _enumerateResultSet:resultSet batchSize:NSUIntegerMax usingBlock:^(NSArray *objects, const int64_t *resultRowIDs, BOOL *stop) {
+            [objects enumerateObjectsUsingBlock:^(TNKObject *object, NSUInteger index, BOOL *stop) {
+                objectsByRowID[@(resultRowIDs[index])] = object;
+            }];
+        }];
+        [resultSet close];
+    }
+    
+    // rows that were deleted since the rowids were read are left as NSNull
+    NSMutableArray *objects = [[NSMutableArray alloc] initWithCapacity:count];
+    for (NSUInteger index = 0; index < count; index++) {
+        [objects addObject:objectsByRowID[@(rowIDs[index])] ?: [NSNull null]];
+    }
+    
+    return objects;
+}
+
+// Reads a value from the current row of a result set as an object. Numbers and booleans are returned as NSNumbers.
+static id TNKValueFromResultSet(TNKPropertyDescription *property, FMResultSet *resultSet, int column)
+{
+    if ([resultSet columnIndexIsNull:column]) {
+        return nil;
+    }
+    
+    switch (property.storage) {
+        case TNKPropertyStorageInteger: {
+            return @([resultSet longLongIntForColumnIndex:column]);
+        } case TNKPropertyStorageUnsignedInteger: {
+            return @([resultSet unsignedLongLongIntForColumnIndex:column]);
+        } case TNKPropertyStorageDouble: {
+            return @([resultSet doubleForColumnIndex:column]);
+        } case TNKPropertyStorageObject: {
+            TNKSlot slot;
+            if (!TNKSlotFromResultSet(&slot, property, resultSet, column)) {
+                return nil;
+            }
+            
+            return CFBridgingRelease(slot.objectValue);
+        }
+    }
+}
+
++ (NSArray *)valuesForQuery:(TNKObjectQuery *)objectQuery inDatabase:(FMDatabase *)db
+{
+    NSMutableArray *values = [NSMutableArray new];
+    [self enumerateValuesForQuery:objectQuery inDatabase:db batchSize:NSUIntegerMax usingBlock:^(NSArray *batch, BOOL *stop) {
+        [values addObjectsFromArray:batch];
+    }];
+    
+    return values;
+}
+
++ (void)enumerateValuesForQuery:(TNKObjectQuery *)objectQuery inDatabase:(FMDatabase *)db batchSize:(NSUInteger)batchSize usingBlock:(void(^)(NSArray *values, BOOL *stop))block
+{
+    NSAssert(objectQuery.resultType != TNKObjectQueryResultTypeObjects, @"Object results must be read with executeQuery:inDatabase:.");
+    
+    TNKEntityDescription *entity = [self entityDescription];
+    NSArray *keys = [objectQuery.keysToFetch allObjects];
+    NSAssert(objectQuery.resultType != TNKObjectQueryResultTypeValues || keys.count == 1, @"Value results need exactly one key to fetch, not %@.", keys);
+    
+    NSMutableArray *properties = [[NSMutableArray alloc] initWithCapacity:keys.count];
+    for (NSString *key in keys) {
+        TNKPropertyDescription *property = [entity propertyForKey:key];
+        NSAssert(property != nil, @"%@ is not a persistent key of %@.", key, NSStringFromClass(self));
+        [properties addObject:property];
+    }
+    
+    NSArray *arguments = [objectQuery.predicate sqliteWhereClauseArguments] ?: @[];
+    NSString *query = [self _selectQueryWithColumns:[[properties valueForKey:@"name"] componentsJoinedByString:@", "] forObjectQuery:objectQuery];
+    
+    FMResultSet *resultSet = [db executeQuery:query withArgumentsInArray:arguments];
+    BOOL hasRows = resultSet != nil;
+    BOOL stop = NO;
+    while (hasRows && !stop) {
+        // values that the block doesn't keep are released after each batch
+        @autoreleasepool {
+            NSMutableArray *values = [NSMutableArray new];
+            while (values.count < batchSize && (hasRows = [resultSet next])) {
+                if (objectQuery.resultType == TNKObjectQueryResultTypeValues) {
+                    [values addObject:TNKValueFromResultSet(properties.firstObject, resultSet, 0) ?: [NSNull null]];
+                    continue;
+                }
+                
+                NSMutableDictionary *row = [[NSMutableDictionary alloc] initWithCapacity:properties.count];
+                [properties enumerateObjectsUsingBlock:^(TNKPropertyDescription *property, NSUInteger column, BOOL *stop) {
+                    id value = TNKValueFromResultSet(property, resultSet, (int)column);
+                    if (value != nil) {
+                        row[property.name] = value;
+                    }
+                }];
+                [values addObject:row];
+            }
+            
+            if (values.count > 0) {
+                block(values, &stop);
+            }
+        }
+    }
+    [resultSet close];
+}
+
+// must be called while holding the object's lock, or while the object is being created before any other thread can see it
+- (void)_setFaultedValueForProperty:(TNKPropertyDescription *)property fromResultSet:(FMResultSet *)resultSet columnIndex:(int)column
+{
+    TNKSlot value;
+    if (!TNKSlotFromResultSet(&value, property, resultSet, column)) {
+        return;
+    }
+    
+    TNKSlot *slot = &_slots[property.index];
+    if (property.storage == TNKPropertyStorageObject && slot->objectValue != NULL) {
+        CFRelease(slot->objectValue);
+    }
+    *slot = value;
+    
+    TNKMaskAddIndex(_faultedMask, property.index);
+}
+
+- (void)getPrimaryKeyValues:(TNKSlot *)values
+{
+    pthread_mutex_lock(_lock);
+    
+    NSUInteger index = 0;
+    for (TNKPropertyDescription *property in _entity.primaryKeyProperties) {
+        values[index] = _slots[property.index];
+        if (property.storage == TNKPropertyStorageObject && values[index].objectValue != NULL) {
+            CFRetain(values[index].objectValue);
+        }
+        
+        index++;
+    }
+    
+    pthread_mutex_unlock(_lock);
+}
+
+- (void)replaceAllocatedObjectID:(NSUInteger)objectID
+{
+    TNKPropertyDescription *property = [_entity propertyForKey:@"objectID"];
+    
+    pthread_mutex_lock(_lock);
+    _slots[property.index].unsignedIntegerValue = objectID;
+    TNKMaskAddIndex(_faultedMask, property.index);
+    pthread_mutex_unlock(_lock);
+}
+
+
+#pragma mark - Statements
+
+// subclasses that customize how a single object is saved still get called for each object
++ (BOOL)_overridesInstanceMethod:(SEL)selector
+{
+    return [self instanceMethodForSelector:selector] != [TNKObject instanceMethodForSelector:selector];
+}
+
+static sqlite3_stmt *TNKPrepareStatement(FMDatabase *db, NSString *sql)
+{
+    sqlite3_stmt *statement = NULL;
+    if (sqlite3_prepare_v2(db.sqliteHandle, sql.UTF8String, -1, &statement, NULL) != SQLITE_OK) {
+        NSLog(@"Error preparing statement: %@ (%@)", sql, db.lastErrorMessage);
+        sqlite3_finalize(statement);
+        return NULL;
+    }
+    
+    return statement;
+}
+
+// steps a statement that doesn't return rows, and resets it so that it can be bound again
+static BOOL TNKStepStatement(FMDatabase *db, sqlite3_stmt *statement)
+{
+    int result = sqlite3_step(statement);
+    BOOL success = result == SQLITE_DONE || result == SQLITE_ROW;
+    if (!success) {
+        NSLog(@"Error executing statement: %s (%@)", sqlite3_sql(statement), db.lastErrorMessage);
+    }
+    
+    sqlite3_reset(statement);
+    sqlite3_clear_bindings(statement);
+    
+    return success;
+}
+
+static void TNKBindObject(sqlite3_stmt *statement, int column, id value)
+{
+    if (value == nil || value == [NSNull null]) {
+        sqlite3_bind_null(statement, column);
+    } else if ([value isKindOfClass:[NSString class]]) {
+        sqlite3_bind_text(statement, column, [value UTF8String], -1, SQLITE_TRANSIENT);
+    } else if ([value isKindOfClass:[NSNumber class]]) {
+        const char *type = [value objCType];
+        if (strcmp(type, @encode(float)) == 0 || strcmp(type, @encode(double)) == 0) {
+            sqlite3_bind_double(statement, column, [value doubleValue]);
+        } else if (strcmp(type, @encode(unsigned long long)) == 0) {
+            sqlite3_bind_int64(statement, column, (sqlite3_int64)[value unsignedLongLongValue]);
+        } else {
+            sqlite3_bind_int64(statement, column, [value longLongValue]);
+        }
+    } else if ([value isKindOfClass:[NSDate class]]) {
+        sqlite3_bind_double(statement, column, [value timeIntervalSince1970]);
+    } else if ([value isKindOfClass:[NSData class]]) {
+        // an empty NSData may not have bytes, and a NULL pointer would bind NULL instead of an empty blob
+        sqlite3_bind_blob(statement, column, [value bytes] ?: "", (int)[value length], SQLITE_TRANSIENT);
+    } else {
+        sqlite3_bind_text(statement, column, [[value description] UTF8String], -1, SQLITE_TRANSIENT);
+    }
+}
+
+// must be called while holding the object's lock
+- (int)_bindProperties:(NSArray *)properties toStatement:(sqlite3_stmt *)statement startingAtColumn:(int)column
+{
+    for (TNKPropertyDescription *property in properties) {
+        TNKSlot slot = _slots[property.index];
+        switch (property.storage) {
+            case TNKPropertyStorageInteger:
+                sqlite3_bind_int64(statement, column, slot.integerValue);
+                break;
+            case TNKPropertyStorageUnsignedInteger:
+                sqlite3_bind_int64(statement, column, (sqlite3_int64)slot.unsignedIntegerValue);
+                break;
+            case TNKPropertyStorageDouble:
+                sqlite3_bind_double(statement, column, slot.doubleValue);
+                break;
+            case TNKPropertyStorageObject:
+                TNKBindObject(statement, column, (__bridge id)slot.objectValue);
+                break;
+        }
+        
+        column++;
+    }
+    
+    return column;
+}
+
++ (NSArray *)_propertiesInMask:(const uint64_t *)mask
+{
+    NSMutableArray *properties = [NSMutableArray new];
+    for (TNKPropertyDescription *property in [self entityDescription].properties) {
+        if (TNKMaskContainsIndex(mask, property.index)) {
+            [properties addObject:property];
+        }
+    }
+    
+    return properties;
+}
+
+// Groups objects that have the same changed properties, so that they can share a statement. Changes made since the save started
+// are included, since their current values are what gets written.
++ (NSDictionary *)_objectsGroupedByChangedProperties:(NSArray *)objects
+{
+    NSUInteger maskWordCount = TNKMaskWordCount([self entityDescription].properties.count);
+    NSMutableDictionary *groups = [NSMutableDictionary new];
+    for (TNKObject *object in objects) {
+        NSMutableData *mask = [[NSMutableData alloc] initWithLength:maskWordCount * sizeof(uint64_t)];
+        uint64_t *maskWords = mask.mutableBytes;
+        pthread_mutex_lock(object->_lock);
+        for (NSUInteger word = 0; word < maskWordCount; word++) {
+            maskWords[word] = object->_changedMask[word] | object->_savingMask[word];
+        }
+        pthread_mutex_unlock(object->_lock);
+        
+        NSMutableArray *group = groups[mask];
+        if (group == nil) {
+            group = [NSMutableArray new];
+            groups[mask] = group;
+        }
+        [group addObject:object];
+    }
+    
+    return groups;
+}
+
+// joins count copies of a string, for building lists of placeholders
+static NSString *TNKRepeatedString(NSString *string, NSUInteger count, NSString *separator)
+{
+    NSMutableString *repeatedString = [[NSMutableString alloc] initWithCapacity:(string.length + separator.length) * count];
+    for (NSUInteger index = 0; index < count; index++) {
+        if (index > 0) {
+            [repeatedString appendString:separator];
+        }
+        [repeatedString appendString:string];
+    }
+    
+    return repeatedString;
+}
+
+// the number of rows that fit in a single statement when each row uses variablesPerRow ? placeholders
+static NSUInteger TNKMaximumRowsPerStatement(FMDatabase *db, NSUInteger variablesPerRow, BOOL multipleRowValues)
+{
+    NSUInteger rows = (NSUInteger)sqlite3_limit(db.sqliteHandle, SQLITE_LIMIT_VARIABLE_NUMBER, -1) / MAX(variablesPerRow, 1);
+    
+    // multi-row VALUES are run as a compound SELECT, so they are limited by that as well
+    int compoundLimit = sqlite3_limit(db.sqliteHandle, SQLITE_LIMIT_COMPOUND_SELECT, -1);
+    if (multipleRowValues && compoundLimit > 0) {
+        rows = MIN(rows, (NSUInteger)compoundLimit);
+    }
+    
+    return MAX(rows, 1);
+}
+
+// Runs a statement for every rowsPerStatement objects. Only 2 statements are ever prepared, one for full batches and one for the
+// remainder. The bind block binds a single object starting at the given column and returns the next column.
+static BOOL TNKExecuteBatches(FMDatabase *db, NSArray *objects, NSUInteger rowsPerStatement, NSString *(^sqlForRowCount)(NSUInteger rowCount), int (^bind)(TNKObject *object, sqlite3_stmt *statement, int column), void (^didExecute)(NSArray *batch))
+{
+    BOOL success = YES;
+    sqlite3_stmt *fullStatement = NULL;
+    
+    for (NSUInteger start = 0; start < objects.count; start += rowsPerStatement) {
+        NSUInteger rowCount = MIN(rowsPerStatement, objects.count - start);
+        
+        sqlite3_stmt *statement = rowCount == rowsPerStatement ? fullStatement : NULL;
+        if (statement == NULL) {
+            statement = TNKPrepareStatement(db, sqlForRowCount(rowCount));
+            if (statement == NULL) {
+                success = NO;
+                break;
+            }
+            
+            if (rowCount == rowsPerStatement) {
+                fullStatement = statement;
+            }
+        }
+        
+        NSArray *batch = [objects subarrayWithRange:NSMakeRange(start, rowCount)];
+        int column = 1;
+        for (TNKObject *object in batch) {
+            column = bind(object, statement, column);
+        }
+        
+        success = TNKStepStatement(db, statement);
+        if (statement != fullStatement) {
+            sqlite3_finalize(statement);
+        }
+        
+        if (!success) {
+            break;
+        }
+        
+        if (didExecute != nil) {
+            didExecute(batch);
+        }
+    }
+    
+    sqlite3_finalize(fullStatement);
+    
+    return success;
+}
+
++ (BOOL)_insertObjects:(NSArray *)objects intoDatabase:(FMDatabase *)db
+{
+    TNKEntityDescription *entity = [self entityDescription];
+    TNKPropertyDescription *objectIDProperty = [entity propertyForKey:@"objectID"];
+    
+    __block BOOL success = YES;
+    [[self _objectsGroupedByChangedProperties:objects] enumerateKeysAndObjectsUsingBlock:^(NSData *mask, NSArray *group, BOOL *stop) {
+        NSArray *properties = [self _propertiesInMask:mask.bytes];
+        NSString *columns = [[properties valueForKey:@"name"] componentsJoinedByString:@", "];
+        NSString *row = [NSString stringWithFormat:@"(%@)", TNKRepeatedString(@"?", properties.count, @", ")];
+        
+        // the connection assigns objectIDs when objects are inserted, so this is only needed for classes it doesn't know about
+        BOOL assignsObjectID = objectIDProperty != nil && ![properties containsObject:objectIDProperty];
+        
+        // DEFAULT VALUES can only insert a single row. SQLite doesn't promise that the rows of one statement get consecutive
+        // rowids, so rows that need their rowid read back are inserted one at a time as well.
+        NSUInteger rowsPerStatement = properties.count > 0 && !assignsObjectID ? TNKMaximumRowsPerStatement(db, properties.count, YES) : 1;
+        
+        success = TNKExecuteBatches(db, group, rowsPerStatement, ^NSString *(NSUInteger rowCount) {
+            if (properties.count == 0) {
+                return [NSString stringWithFormat:@"INSERT INTO %@ DEFAULT VALUES", entity.tableName];
+            }
+            
+            return [NSString stringWithFormat:@"INSERT INTO %@ (%@) VALUES %@", entity.tableName, columns, TNKRepeatedString(row, rowCount, @", ")];
+        }, ^int(TNKObject *object, sqlite3_stmt *statement, int column) {
+            pthread_mutex_lock(object->_lock);
+            column = [object _bindProperties:properties toStatement:statement startingAtColumn:column];
+            pthread_mutex_unlock(object->_lock);
+            
+            return column;
+        }, ^(NSArray *batch) {
+            if (!assignsObjectID) {
+                return;
+            }
+            
+            TNKObject *object = batch.firstObject;
+            pthread_mutex_lock(object->_lock);
+            object->_slots[objectIDProperty.index].unsignedIntegerValue = (uint64_t)sqlite3_last_insert_rowid(db.sqliteHandle);
+            TNKMaskAddIndex(object->_faultedMask, objectIDProperty.index);
+            pthread_mutex_unlock(object->_lock);
+        });
+        
+        *stop = !success;
+    }];
+    
+    return success;
+}
+
++ (BOOL)_updateObjects:(NSArray *)objects inDatabase:(FMDatabase *)db
+{
+    TNKEntityDescription *entity = [self entityDescription];
+    NSMutableArray *keyClauses = [NSMutableArray new];
+    for (TNKPropertyDescription *property in entity.primaryKeyProperties) {
+        [keyClauses addObject:[NSString stringWithFormat:@"%@ = ?", property.name]];
+    }
+    NSString *whereClause = [keyClauses componentsJoinedByString:@" AND "];
+    
+    __block BOOL success = YES;
+    [[self _objectsGroupedByChangedProperties:objects] enumerateKeysAndObjectsUsingBlock:^(NSData *mask, NSArray *group, BOOL *stop) {
+        NSArray *properties = [self _propertiesInMask:mask.bytes];
+        if (properties.count == 0) {
+            return;
+        }
+        
+        NSMutableArray *setClauses = [[NSMutableArray alloc] initWithCapacity:properties.count];
+        for (TNKPropertyDescription *property in properties) {
+            [setClauses addObject:[NSString stringWithFormat:@"%@ = ?", property.name]];
+        }
+        
+        NSString *sql = [NSString stringWithFormat:@"UPDATE %@ SET %@ WHERE %@", entity.tableName, [setClauses componentsJoinedByString:@", "], whereClause];
+        sqlite3_stmt *statement = TNKPrepareStatement(db, sql);
+        if (statement == NULL) {
+            success = NO;
+            *stop = YES;
+            return;
+        }
+        
+        for (TNKObject *object in group) {
+            pthread_mutex_lock(object->_lock);
+            int column = [object _bindProperties:properties toStatement:statement startingAtColumn:1];
+            [object _bindProperties:entity.primaryKeyProperties toStatement:statement startingAtColumn:column];
+            pthread_mutex_unlock(object->_lock);
+            
+            if (!TNKStepStatement(db, statement)) {
+                success = NO;
+                break;
+            }
+        }
+        
+        sqlite3_finalize(statement);
+        *stop = !success;
+    }];
+    
+    return success;
+}
+
++ (BOOL)_deleteObjects:(NSArray *)objects fromDatabase:(FMDatabase *)db
+{
+    TNKEntityDescription *entity = [self entityDescription];
+    NSArray *primaryKeyProperties = entity.primaryKeyProperties;
+    
+    // with a single primary key we can delete many rows with an IN clause, otherwise each row needs it's own statement
+    BOOL deletesMultipleRows = primaryKeyProperties.count == 1;
+    NSUInteger rowsPerStatement = deletesMultipleRows ? TNKMaximumRowsPerStatement(db, 1, NO) : 1;
+    
+    NSMutableArray *keyClauses = [NSMutableArray new];
+    for (TNKPropertyDescription *property in primaryKeyProperties) {
+        [keyClauses addObject:[NSString stringWithFormat:@"%@ = ?", property.name]];
+    }
+    NSString *whereClause = [keyClauses componentsJoinedByString:@" AND "];
+    
+    return TNKExecuteBatches(db, objects, rowsPerStatement, ^NSString *(NSUInteger rowCount) {
+        if (deletesMultipleRows) {
+            return [NSString stringWithFormat:@"DELETE FROM %@ WHERE %@ IN (%@)", entity.tableName, [primaryKeyProperties.firstObject name], TNKRepeatedString(@"?", rowCount, @", ")];
+        }
+        
+        return [NSString stringWithFormat:@"DELETE FROM %@ WHERE %@", entity.tableName, whereClause];
+    }, ^int(TNKObject *object, sqlite3_stmt *statement, int column) {
+        pthread_mutex_lock(object->_lock);
+        column = [object _bindProperties:primaryKeyProperties toStatement:statement startingAtColumn:column];
+        pthread_mutex_unlock(object->_lock);
+        
+        return column;
+    }, nil);
+}
+
+
+#pragma mark - Insertion
+
++ (void)initialize
+{
+    if (self == [TNKObject class]) {
+        // kept for the block locks, which are created as they are needed
+        pthread_mutexattr_init(&TNKRecursiveLockAttributes);
+        pthread_mutexattr_settype(&TNKRecursiveLockAttributes, PTHREAD_MUTEX_RECURSIVE);
+        for (NSUInteger index = 0; index < TNKObjectLockStripeCount; index++) {
+            pthread_mutex_init(&TNKObjectLocks[index], &TNKRecursiveLockAttributes);
+        }
+    }
+}
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self) {
+        // objects are at least 16 byte aligned, so the low bits of the address are always the same
+        uintptr_t address = (uintptr_t)(__bridge void *)self;
+        _lock = &TNKObjectLocks[((address >> 4) ^ (address >> 12)) % TNKObjectLockStripeCount];
+        
+        _entity = [self.class entityDescription];
+        
+        NSUInteger count = _entity.properties.count;
+        NSUInteger maskWordCount = TNKMaskWordCount(count);
+        _slots = calloc(1, count * sizeof(TNKSlot) + maskWordCount * 3 * sizeof(uint64_t));
+        _faultedMask = (uint64_t *)(_slots + count);
+        _changedMask = _faultedMask + maskWordCount;
+        _savingMask = _changedMask + maskWordCount;
+    }
+    
+    return self;
+}
+
+- (void)dealloc
+{
+    for (TNKPropertyDescription *property in _entity.properties) {
+        if (property.storage == TNKPropertyStorageObject && _slots[property.index].objectValue != NULL) {
+            CFRelease(_slots[property.index].objectValue);
+        }
+    }
+    
+    free(_slots);
+    
+    if (_blockLock != NULL) {
+        pthread_mutex_destroy(_blockLock);
+        free(_blockLock);
+    }
+}
+
++ (instancetype)find:(NSDictionary *)values
+{
+    return [self find:values usingQuery:nil];
+}
+
++ (instancetype)find:(NSDictionary *)values usingQuery:(void(^)(TNKObjectQuery *query))queryBlock
 {
     TNKObject *object = [[TNKConnection currentConnection] existingObjectWithClass:self.class primaryValues:values];
     
@@ -718,32 +1542,197 @@
 }
 
 
+#pragma mark - Bulk Changes
+
+// Finds the registered objects whose rows match a where clause. Only the primary keys of the rows are read, and rows that aren't
+// registered are skipped without creating an object.
++ (NSArray *)_registeredObjectsWhere:(NSString *)whereClause arguments:(NSArray *)arguments identityMap:(TNKIdentityMap *)identityMap inDatabase:(FMDatabase *)db
+{
+    TNKEntityDescription *entity = [self entityDescription];
+    NSArray *primaryKeyProperties = entity.primaryKeyProperties;
+    NSUInteger primaryKeyCount = primaryKeyProperties.count;
+    if (identityMap == nil || primaryKeyCount == 0) {
+        return @[];
+    }
+    
+    NSString *query = [NSString stringWithFormat:@"SELECT %@ FROM %@ WHERE %@", [[primaryKeyProperties valueForKey:@"name"] componentsJoinedByString:@", "], entity.tableName, whereClause];
+    FMResultSet *resultSet = [db executeQuery:query withArgumentsInArray:arguments];
+    
+    NSMutableArray *objects = [NSMutableArray new];
+    TNKSlot primaryKeyValues[primaryKeyCount];
+    while ([resultSet next]) {
+        BOOL validKey = YES;
+        for (NSUInteger index = 0; index < primaryKeyCount; index++) {
+            primaryKeyValues[index].objectValue = NULL;
+            validKey = TNKSlotFromResultSet(&primaryKeyValues[index], primaryKeyProperties[index], resultSet, (int)index) && validKey;
+        }
+        
+        TNKObject *object = validKey ? [identityMap objectForPrimaryKeyValues:primaryKeyValues] : nil;
+        [identityMap releasePrimaryKeyValues:primaryKeyValues];
+        
+        if (object != nil) {
+            [objects addObject:object];
+        }
+    }
+    [resultSet close];
+    
+    return objects;
+}
+
+// Runs a single statement against the rows matching a predicate, after saving the connection so that the statement sees it's
+// pending changes. The registered objects that match are found first, since the statement may change which rows match. Returns
+// the number of rows changed, or NSNotFound if the statement failed.
++ (NSUInteger)_executeStatement:(NSString *)sql values:(NSArray *)values matchingPredicate:(NSPredicate *)predicate registeredObjects:(NSArray **)registeredObjects
+{
+    TNKConnection *connection = [TNKConnection currentConnection];
+    TNKIdentityMap *identityMap = [connection identityMapForClass:self];
+    
+    NSString *whereClause = predicate != nil ? [predicate sqliteWhereClause] : @"1";
+    NSArray *arguments = predicate != nil ? [predicate sqliteWhereClauseArguments] : @[];
+    sql = [NSString stringWithFormat:@"%@ WHERE %@", sql, whereClause];
+    
+    [connection save];
+    
+    __block NSUInteger count = NSNotFound;
+    __block NSArray *objects = nil;
+    [connection.databaseQueue inTransaction:^(FMDatabase *db, BOOL *rollback) {
+        objects = [self _registeredObjectsWhere:whereClause arguments:arguments identityMap:identityMap inDatabase:db];
+        
+        sqlite3_stmt *statement = TNKPrepareStatement(db, sql);
+        if (statement == NULL) {
+            *rollback = YES;
+            return;
+        }
+        
+        int column = 1;
+        for (id value in values) {
+            TNKBindObject(statement, column++, value);
+        }
+        for (id argument in arguments) {
+            TNKBindObject(statement, column++, argument);
+        }
+        
+        if (TNKStepStatement(db, statement)) {
+            count = (NSUInteger)sqlite3_changes(db.sqliteHandle);
+        } else {
+            *rollback = YES;
+        }
+        sqlite3_finalize(statement);
+    }];
+    
+    if (registeredObjects != NULL) {
+        *registeredObjects = count != NSNotFound ? objects : @[];
+    }
+    
+    return count;
+}
+
++ (NSUInteger)deleteObjectsMatchingPredicate:(NSPredicate *)predicate
+{
+    NSString *sql = [NSString stringWithFormat:@"DELETE FROM %@", [self entityDescription].tableName];
+    
+    NSArray *registeredObjects = nil;
+    NSUInteger count = [self _executeStatement:sql values:nil matchingPredicate:predicate registeredObjects:&registeredObjects];
+    
+    // the rows are already gone, so the objects are marked as deleted without queuing another delete, and are no longer found by
+    // their primary keys, so that a new object can be inserted with the same keys
+    TNKIdentityMap *identityMap = [[TNKConnection currentConnection] identityMapForClass:self];
+    TNKSlot primaryKeyValues[MAX([self entityDescription].primaryKeyProperties.count, 1)];
+    for (TNKObject *object in registeredObjects) {
+        [object addState:TNKObjectStateDeleted];
+        
+        [object getPrimaryKeyValues:primaryKeyValues];
+        [identityMap unregisterObject:object withPrimaryKeyValues:primaryKeyValues];
+        [identityMap releasePrimaryKeyValues:primaryKeyValues];
+    }
+    
+    return count;
+}
+
++ (NSUInteger)updateObjectsMatchingPredicate:(NSPredicate *)predicate values:(NSDictionary *)values
+{
+    TNKEntityDescription *entity = [self entityDescription];
+    
+    NSMutableArray *properties = [[NSMutableArray alloc] initWithCapacity:values.count];
+    NSMutableArray *setClauses = [[NSMutableArray alloc] initWithCapacity:values.count];
+    NSMutableArray *setValues = [[NSMutableArray alloc] initWithCapacity:values.count];
+    for (NSString *key in values) {
+        TNKPropertyDescription *property = [entity propertyForKey:key];
+        NSAssert(property != nil, @"%@ is not a persistent key of %@.", key, NSStringFromClass(self));
+        NSAssert(!property.isPrimaryKey, @"Primary keys can't be updated by predicate.");
+        
+        [properties addObject:property];
+        [setClauses addObject:[NSString stringWithFormat:@"%@ = ?", property.name]];
+        [setValues addObject:values[key]];
+    }
+    
+    if (properties.count == 0) {
+        return 0;
+    }
+    
+    NSString *sql = [NSString stringWithFormat:@"UPDATE %@ SET %@", entity.tableName, [setClauses componentsJoinedByString:@", "]];
+    
+    NSArray *registeredObjects = nil;
+    NSUInteger count = [self _executeStatement:sql values:setValues matchingPredicate:predicate registeredObjects:&registeredObjects];
+    
+    // unsaved changes made since the statement ran will overwrite it on the next save, so they are kept
+    for (TNKObject *object in registeredObjects) {
+        pthread_mutex_lock(object->_lock);
+        NSUInteger index = 0;
+        for (TNKPropertyDescription *property in properties) {
+            if (!TNKMaskContainsIndex(object->_changedMask, property.index) && !TNKMaskContainsIndex(object->_savingMask, property.index)) {
+                [object _setPrimitiveValue:setValues[index] forProperty:property];
+            }
+            index++;
+        }
+        pthread_mutex_unlock(object->_lock);
+    }
+    
+    return count;
+}
+
+
 #pragma mark - Concurrency
 
+// Objects share their striped locks with unrelated objects, so those are only ever held around our own reads and writes of the
+// slots. Blocks are serialized by a lock of the object's own instead, so that nesting blocks for different objects can't deadlock
+// just because the objects happen to share a stripe. The stripe is never held while waiting for a block lock.
+
+- (pthread_mutex_t *)_blockLock
+{
+    pthread_mutex_lock(_lock);
+    if (_blockLock == NULL) {
+        _blockLock = malloc(sizeof(pthread_mutex_t));
+        pthread_mutex_init(_blockLock, &TNKRecursiveLockAttributes);
+    }
+    pthread_mutex_t *blockLock = _blockLock;
+    pthread_mutex_unlock(_lock);
+    
+    return blockLock;
+}
+
 - (void)performBlock:(void(^)())block
 {
-    if ([[NSThread currentThread].threadDictionary[TNKInObjectQueueThreadKey] boolValue]) {
-        block();
-    } else {
-        dispatch_async(_propertyQueue, ^{
-            [NSThread currentThread].threadDictionary[TNKInObjectQueueThreadKey] = @YES;
-            block();
-            [[NSThread currentThread].threadDictionary removeObjectForKey:TNKInObjectQueueThreadKey];
-        });
+    // the queue keeps asynchronous blocks in the order they were added
+    pthread_mutex_lock(_lock);
+    if (_blockQueue == nil) {
+        _blockQueue = dispatch_queue_create("TNKObject_block", DISPATCH_QUEUE_SERIAL);
     }
+    dispatch_queue_t blockQueue = _blockQueue;
+    pthread_mutex_unlock(_lock);
+    
+    dispatch_async(blockQueue, ^{
+        [self performBlockAndWait:block];
+    });
 }
 
 - (void)performBlockAndWait:(void(^)())block
 {
-    if ([[NSThread currentThread].threadDictionary[TNKInObjectQueueThreadKey] boolValue]) {
-        block();
-    } else {
-        dispatch_sync(_propertyQueue, ^{
-            [NSThread currentThread].threadDictionary[TNKInObjectQueueThreadKey] = @YES;
-            block();
-            [[NSThread currentThread].threadDictionary removeObjectForKey:TNKInObjectQueueThreadKey];
-        });
-    }
+    pthread_mutex_t *blockLock = [self _blockLock];
+    
+    pthread_mutex_lock(blockLock);
+    block();
+    pthread_mutex_unlock(blockLock);
 }
 
 
@@ -759,7 +1748,8 @@
     
     NSDictionary *faultedValues = self.faultedValues;
     BOOL first = YES;
-    for (NSString *key in [self.class persistentKeys]) {
+    for (TNKPropertyDescription *property in [self.class entityDescription].properties) {
+        NSString *key = property.name;
         if (!first) {
             [description appendString:@", "];
         }
@@ -9,6 +9,18 @@
 #import <Foundation/Foundation.h>
 
 
+/** What `-[TNKObjectQuery run]` returns for each row
+ */
+typedef NS_ENUM(NSUInteger, TNKObjectQueryResultType) {
+    /** Instances of the query's `objectClass`, registered with the connection. */
+    TNKObjectQueryResultTypeObjects,
+    /** An `NSDictionary` of the `keysToFetch` and their values. Keys that are NULL in the database are left out. */
+    TNKObjectQueryResultTypeDictionaries,
+    /** The value of the single key in `keysToFetch`, or `NSNull` if it is NULL in the database. */
+    TNKObjectQueryResultTypeValues,
+};
+
+
 @interface TNKObjectQuery : NSObject
 
 /** Create a new query
@@ -28,7 +40,8 @@
 
 /** The keys that should be fetched with the object.
  
- Returns all the classes persistent keys when `returnObjectsAsFaults` is set to NO (the default).
+ Returns all the classes persistent keys when `returnObjectsAsFaults` is set to NO (the default). For dictionary and value
+ results, these are the keys that are read, and all the persistent keys are read if it is nil.
  */
 @property (nonatomic, copy) NSSet *keysToFetch;
 
@@ -38,12 +51,41 @@
  */
 @property (nonatomic) BOOL returnObjectsAsFaults;
 
+/** The kind of results to return.
+ 
+ Dictionary and value results are read straight from the database, without creating any objects, so they are much cheaper
+ when only a few keys of many rows are needed. They are not registered with the connection, so they don't include unsaved
+ changes, and changing them does not change the database. `TNKObjectQueryResultTypeObjects` by default.
+ */
+@property (nonatomic) TNKObjectQueryResultType resultType;
+
+/** Leave out repeated results.
+ 
+ This is most useful with dictionary or value results, such as to get the distinct values of a key. NO by default.
+ */
+@property (nonatomic) BOOL returnsDistinctResults;
+
 /** The maximum number of objects to return.
  
- Use this to limit the number of objects returned by the query.
+ Use this to limit the number of objects returned by the query. The limit is applied by the database, so only that many rows are
+ read. 0, the default, means there is no limit.
  */
 @property (nonatomic) NSUInteger limit;
 
+/** The number of matching objects to skip.
+ 
+ Combined with `limit` and `sortDescriptors`, this can be used to read a page of results at a time. 0 by default.
+ */
+@property (nonatomic) NSUInteger offset;
+
+/** How to sort the results.
+ 
+ An array of `NSSortDescriptor`s with persistent keys. They are converted to an SQL ORDER BY clause, so they can't use comparator
+ blocks. See `-[NSSortDescriptor sqliteOrderClause]` for the selectors that are supported. The order is undefined if this is
+ empty.
+ */
+@property (nonatomic, copy) NSArray *sortDescriptors;
+
 /** The predicate to filter the results by.
  
  This will be converted to an SQL where clause. Becasue of this, make sure that you do not use unsupported predicates (such as
@@ -52,12 +94,47 @@
 @property (nonatomic, copy) NSPredicate *predicate;
 
 
+/** The number of objects to read at a time when enumerating the results.
+ 
+ This is also the page size of paged results. 0, the default, uses a batch size of 100.
+ */
+@property (nonatomic) NSUInteger fetchBatchSize;
+
+/** Return a `TNKPagedArray` from `run`.
+ 
+ Paged results only read the rowids of the results when the query is run, and read the objects a page of `fetchBatchSize` at a
+ time as they are accessed. This only applies to object results. NO by default.
+ */
+@property (nonatomic) BOOL returnsPagedResults;
+
+/** The number of pages to read ahead of the one being accessed, when `returnsPagedResults` is set.
+ 
+ 1 by default.
+ */
+@property (nonatomic) NSUInteger prefetchPageCount;
+
+
 /** Execute the query
  
  Executes the query on the database.
  
- @return An array of the results.
+ @return An array of the results, as described by `resultType`. If `returnsPagedResults` is set, this is a `TNKPagedArray`.
  */
 - (NSArray *)run;
 
+/** Execute the query, and read the results a batch at a time
+ 
+ Only `fetchBatchSize` results are read from the database at a time, and results the block doesn't keep are released after each
+ batch, so that large tables can be read in constant memory. The first results are available as soon as the first batch is read.
+ This is the same for objects, dictionaries and values.
+ 
+ The block is called on the current thread, while the query holds one of the connection's readers.
+ 
+ @warning *Note:* in memory databases read from the same queue that saves use, so don't save an in memory connection inside the
+ block.
+ 
+ @param block Called with each result in order, as described by `resultType`. Set stop to YES to stop enumerating.
+ */
+- (void)enumerateObjectsWithBlock:(void(^)(id object, BOOL *stop))block;
+
 @end
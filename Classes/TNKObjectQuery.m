@@ -10,12 +10,21 @@
 
 #import "TNKData.h"
 #import "TNKConnection_Private.h"
+#import "TNKObject_Private.h"
+#import "TNKPagedArray.h"
+
+
+#define TNKDefaultFetchBatchSize 100
 
 
 @implementation TNKObjectQuery
 
 - (NSSet *)keysToFetch
 {
+    if (self.resultType != TNKObjectQueryResultTypeObjects) {
+        return _keysToFetch ?: [self.objectClass persistentKeys];
+    }
+    
     if (!self.returnObjectsAsFaults) {
         return [self.objectClass persistentKeys];
     }
@@ -34,6 +43,7 @@
     self = [super init];
     if (self) {
         _objectClass = objectClass;
+        _prefetchPageCount = 1;
     }
     
     return self;
@@ -41,12 +51,47 @@
 
 - (NSArray *)run
 {
+    if (self.resultType != TNKObjectQueryResultTypeObjects) {
+        __block NSArray *values = nil;
+        [[TNKConnection currentConnection] performRead:^(FMDatabase *db) {
+            values = [self.objectClass valuesForQuery:self inDatabase:db];
+        }];
+        
+        return values;
+    }
+    
+    if (self.returnsPagedResults) {
+        return [[TNKPagedArray alloc] initWithObjectQuery:self connection:[TNKConnection currentConnection]];
+    }
+    
     __block NSArray *objects = nil;
-    [[TNKConnection currentConnection].databaseQueue inTransaction:^(FMDatabase *db, BOOL *rollback) {
+    [[TNKConnection currentConnection] performRead:^(FMDatabase *db) {
         objects = [self.objectClass executeQuery:self inDatabase:db];
     }];
     
     return objects;
 }
 
+- (void)enumerateObjectsWithBlock:(void(^)(id object, BOOL *stop))block
+{
+    NSUInteger batchSize = self.fetchBatchSize ?: TNKDefaultFetchBatchSize;
+    void (^batchBlock)(NSArray *, BOOL *) = ^(NSArray *objects, BOOL *stop) {
+        for (id object in objects) {
+            block(object, stop);
+            
+            if (*stop) {
+                break;
+            }
+        }
+    };
+    
+    [[TNKConnection currentConnection] performRead:^(FMDatabase *db) {
+        if (self.resultType == TNKObjectQueryResultTypeObjects) {
+            [self.objectClass enumerateQuery:self inDatabase:db batchSize:batchSize usingBlock:batchBlock];
+        } else {
+            [self.objectClass enumerateValuesForQuery:self inDatabase:db batchSize:batchSize usingBlock:batchBlock];
+        }
+    }];
+}
+
 @end
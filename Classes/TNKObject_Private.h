@@ -8,6 +8,164 @@
 
 #import "TNKObject.h"
 
+@class TNKEntityDescription;
+
+
+/** The lifecycle state of an object
+ 
+ Objects can be in more than one state at a time. For instance an object that was inserted and then deleted before being saved.
+ */
+typedef NS_OPTIONS(uint32_t, TNKObjectState) {
+    /** The object is waiting to be inserted on the next save. */
+    TNKObjectStateInserted = 1 << 0,
+    /** The object is waiting to be updated on the next save. */
+    TNKObjectStateUpdated = 1 << 1,
+    /** The object has been deleted. This is not removed after a save. */
+    TNKObjectStateDeleted = 1 << 2,
+    /** The object's objectID was allocated by the connection instead of being set by the app. This is not removed after a save. */
+    TNKObjectStateAllocatedObjectID = 1 << 3,
+};
+
+
+/** The storage for a single persistent value
+ 
+ Which member is used depends on the `storage` of the property. Objects are retained manually.
+ */
+typedef union {
+    int64_t integerValue;
+    uint64_t unsignedIntegerValue;
+    double doubleValue;
+    void *objectValue;
+} TNKSlot;
+
+
 @interface TNKObject ()
 
+/** The cached metadata for the class
+ 
+ Shorthand for `+[TNKEntityDescription entityForClass:]`.
+ */
++ (TNKEntityDescription *)entityDescription;
+
+/** Add the getters and setters for all the persistent keys of the class
+ 
+ Each accessor is generated for it's own property, so it doesn't need to figure out which key it is for when it is called. This
+ is called by the connection for each of it's classes. Classes that are used without a connection get their accessors the first
+ time one of them is resolved.
+ */
++ (void)installPersistentAccessors;
+
+
+/** The current lifecycle state of the object
+ 
+ This is maintained by the connection as objects are inserted, updated, deleted and saved, so that `isInserted`, `isUpdated` and
+ `isDeleted` don't need to ask the connection.
+ */
+@property (nonatomic, readonly) TNKObjectState state;
+
+/** Atomically add lifecycle flags
+ 
+ @param state The flags to add.
+ @return YES if any of the flags were not already set.
+ */
+- (BOOL)addState:(TNKObjectState)state;
+
+/** Atomically remove lifecycle flags
+ 
+ @param state The flags to remove.
+ */
+- (void)removeState:(TNKObjectState)state;
+
+/** Set aside the changed values for a save
+ 
+ Called by the connection when it drains the object for a save. Changes made after this are tracked separately, so that they are
+ saved again by the next save.
+ */
+- (void)beginSavingChanges;
+
+/** Finish a save started with `beginSavingChanges`
+ 
+ @param committed If the save was committed, the changes that were set aside are forgotten, so later updates only write what has
+ changed since. Otherwise they are marked as changed again, to be retried by the next save.
+ */
+- (void)finishSavingChanges:(BOOL)committed;
+
+/** Copy the values of the primary keys
+ 
+ @param values An array with room for each of the entity's `primaryKeyProperties`, which are copied in the same order. Object
+ values are retained and must be released by the caller, for instance with `-[TNKIdentityMap releasePrimaryKeyValues:]`.
+ */
+- (void)getPrimaryKeyValues:(TNKSlot *)values;
+
+/** Replace the objectID of an object that is being inserted
+ 
+ Called by the connection when another connection to the same database already used the id it allocated. The new id isn't
+ recorded as a change, since the insert that is being saved writes it.
+ 
+ @param objectID The new objectID.
+ */
+- (void)replaceAllocatedObjectID:(NSUInteger)objectID;
+
+/** Read the results of a query a batch at a time
+ 
+ Each batch is read inside of it's own autorelease pool, so objects that aren't kept by the block are released before the next
+ batch is read. Classes that override `executeQuery:inDatabase:` get all of their results in a single batch.
+ 
+ @param objectQuery The query to use to generate the SQL query.
+ @param db The database to read the objects from.
+ @param batchSize The largest number of objects to pass to the block at once.
+ @param block Called with each batch of objects, in order. Set stop to YES to stop reading.
+ */
++ (void)enumerateQuery:(TNKObjectQuery *)objectQuery inDatabase:(FMDatabase *)db batchSize:(NSUInteger)batchSize usingBlock:(void(^)(NSArray *objects, BOOL *stop))block;
+
+/** The rowids of the rows matching a query, in order
+ 
+ @param objectQuery The query to use to generate the SQL query.
+ @param db The database to read from.
+ @return The rowids as an array of int64_t.
+ */
++ (NSData *)rowIDsForQuery:(TNKObjectQuery *)objectQuery inDatabase:(FMDatabase *)db;
+
+/** Read the objects for a list of rowids
+ 
+ @param rowIDs The rowids of the rows to read.
+ @param count The number of rowids.
+ @param keysToFetch The persistent keys to read for each object.
+ @param db The database to read from.
+ @return The objects in the same order as the rowids, with `NSNull` for rows that no longer exist, or nil if they couldn't be read.
+ */
++ (NSArray *)objectsWithRowIDs:(const int64_t *)rowIDs count:(NSUInteger)count keysToFetch:(NSSet *)keysToFetch inDatabase:(FMDatabase *)db;
+
+/** Read the dictionary or value results of a query
+ 
+ No objects are created or registered, so the results only include saved changes.
+ 
+ @param objectQuery The query to use to generate the SQL query. It's `resultType` must not be `TNKObjectQueryResultTypeObjects`.
+ @param db The database to read from.
+ @return The results, as described by the query's `resultType`.
+ */
++ (NSArray *)valuesForQuery:(TNKObjectQuery *)objectQuery inDatabase:(FMDatabase *)db;
+
+/** Read the dictionary or value results of a query a batch at a time
+ 
+ Each batch is read inside of it's own autorelease pool, like `enumerateQuery:inDatabase:batchSize:usingBlock:`.
+ 
+ @param objectQuery The query to use to generate the SQL query. It's `resultType` must not be `TNKObjectQueryResultTypeObjects`.
+ @param db The database to read from.
+ @param batchSize The largest number of results to pass to the block at once.
+ @param block Called with each batch of results, in order. Set stop to YES to stop reading.
+ */
++ (void)enumerateValuesForQuery:(TNKObjectQuery *)objectQuery inDatabase:(FMDatabase *)db batchSize:(NSUInteger)batchSize usingBlock:(void(^)(NSArray *values, BOOL *stop))block;
+
+
+/** Runtime introspection used to build the entity description
+ 
+ These look up the property with the Objective-C runtime every time they are called. Use `entityDescription` instead.
+ */
++ (SEL)_getterForPersistentKey:(NSString *)key;
++ (SEL)_setterForPersistentKey:(NSString *)key;
++ (BOOL)_persistentKeyIsReadonly:(NSString *)key;
++ (NSString *)_typeForPersistentKey:(NSString *)key;
++ (Class)_classForPersistentKey:(NSString *)key;
+
 @end
@@ -0,0 +1,49 @@
+//
+//  TNKPagedArray.h
+//  Pods
+//
+//  Created by David Beck on 7/22/14.
+//
+//
+
+#import <Foundation/Foundation.h>
+
+@class TNKObjectQuery;
+@class TNKConnection;
+
+
+/** The results of a query, read from the database a page at a time
+ 
+ When it is created, a paged array only reads the rowids of the matching rows, so it knows it's count without creating any
+ objects. The objects are read a page at a time as they are accessed, along with the next `prefetchPageCount` pages. Only the
+ most recently used pages are kept, so memory stays proportional to the part of the array that is being used.
+ 
+ Returned by `-[TNKObjectQuery run]` when `returnsPagedResults` is set. A paged array can be used from any thread.
+ 
+ @warning *Note:* if a row is deleted after the array is created, but before it's page is read, it's index holds `NSNull`.
+ */
+@interface TNKPagedArray : NSArray
+
+/** Create a paged array for the results of a query
+ 
+ This reads the rowids of the results right away.
+ 
+ @param query The query to read. It is not used after this returns, so later changes to it don't affect the array.
+ @param connection The connection to read from.
+ @return A new paged array.
+ */
+- (instancetype)initWithObjectQuery:(TNKObjectQuery *)query connection:(TNKConnection *)connection;
+
+/** The number of objects read at a time.
+ 
+ The `fetchBatchSize` of the query, or 100 if it wasn't set.
+ */
+@property (nonatomic, readonly) NSUInteger pageSize;
+
+/** The number of pages after the one that is accessed to read along with it.
+ 
+ The `prefetchPageCount` of the query.
+ */
+@property (nonatomic, readonly) NSUInteger prefetchPageCount;
+
+@end
@@ -0,0 +1,178 @@
+//
+//  TNKPagedArray.m
+//  Pods
+//
+//  Created by David Beck on 7/22/14.
+//
+//
+
+#import "TNKPagedArray.h"
+
+#import <pthread.h>
+
+#import "TNKData.h"
+#import "TNKConnection_Private.h"
+#import "TNKObject_Private.h"
+
+
+#define TNKDefaultPageSize 100
+
+// the number of pages kept in memory besides the prefetched ones
+#define TNKCachedPageCount 4
+
+
+@interface TNKPagedArray ()
+{
+    Class _objectClass;
+    NSSet *_keysToFetch;
+    __weak TNKConnection *_connection;
+    
+    NSData *_rowIDs;
+    NSUInteger _count;
+    
+    // guards _pages and _pageOrder
+    pthread_mutex_t _lock;
+    NSMutableDictionary *_pages;
+    // page numbers, least recently used first
+    NSMutableArray *_pageOrder;
+}
+
+@end
+
+@implementation TNKPagedArray
+
+- (instancetype)init
+{
+    NSAssert(NO, @"You cannot call init on TNKPagedArray without a query.");
+    return nil;
+}
+
+- (instancetype)initWithObjectQuery:(TNKObjectQuery *)query connection:(TNKConnection *)connection
+{
+    self = [super init];
+    if (self) {
+        _objectClass = query.objectClass;
+        _keysToFetch = [query.keysToFetch copy];
+        _connection = connection;
+        _pageSize = query.fetchBatchSize ?: TNKDefaultPageSize;
+        _prefetchPageCount = query.prefetchPageCount;
+        
+        pthread_mutex_init(&_lock, NULL);
+        _pages = [NSMutableDictionary new];
+        _pageOrder = [NSMutableArray new];
+        
+        __block NSData *rowIDs = nil;
+        [TNKConnection useConnection:connection block:^(TNKConnection *connection) {
+            [connection performRead:^(FMDatabase *db) {
+                rowIDs = [_objectClass rowIDsForQuery:query inDatabase:db];
+            }];
+        }];
+        _rowIDs = rowIDs;
+        _count = rowIDs.length / sizeof(int64_t);
+    }
+    
+    return self;
+}
+
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_lock);
+}
+
+- (NSUInteger)count
+{
+    return _count;
+}
+
+- (id)objectAtIndex:(NSUInteger)index
+{
+    if (_count == 0) {
+        [NSException raise:NSRangeException format:@"index %lu beyond bounds for empty array", (unsigned long)index];
+    } else if (index >= _count) {
+        [NSException raise:NSRangeException format:@"index %lu beyond bounds [0 .. %lu]", (unsigned long)index, (unsigned long)_count - 1];
+    }
+    
+    NSArray *page = [self _page:index / _pageSize];
+    return page[index % _pageSize];
+}
+
+
+#pragma mark - Pages
+
+- (NSArray *)_page:(NSUInteger)pageNumber
+{
+    pthread_mutex_lock(&_lock);
+    NSArray *page = _pages[@(pageNumber)];
+    if (page != nil) {
+        [self _didUsePage:pageNumber];
+    }
+    pthread_mutex_unlock(&_lock);
+    
+    if (page != nil) {
+        return page;
+    }
+    
+    // read the page along with the prefetched pages in one query, skipping any that are already in memory at the end
+    NSUInteger pageCount = _count > 0 ? (_count - 1) / _pageSize + 1 : 0;
+    NSUInteger lastPageNumber = MIN(pageNumber + _prefetchPageCount, pageCount - 1);
+    pthread_mutex_lock(&_lock);
+    while (lastPageNumber > pageNumber && _pages[@(lastPageNumber)] != nil) {
+        lastPageNumber--;
+    }
+    pthread_mutex_unlock(&_lock);
+    
+    NSUInteger start = pageNumber * _pageSize;
+    NSUInteger length = MIN((lastPageNumber + 1) * _pageSize, _count) - start;
+    const int64_t *rowIDs = (const int64_t *)_rowIDs.bytes + start;
+    
+    __block NSArray *objects = nil;
+    TNKConnection *connection = _connection;
+    [TNKConnection useConnection:connection block:^(TNKConnection *connection) {
+        [connection performRead:^(FMDatabase *db) {
+            objects = [_objectClass objectsWithRowIDs:rowIDs count:length keysToFetch:_keysToFetch inDatabase:db];
+        }];
+    }];
+    
+    // if the connection is gone or the read failed, the page is returned empty without being kept, so that it is read again the next
+    // time it is used
+    if (objects == nil) {
+        NSMutableArray *nulls = [[NSMutableArray alloc] initWithCapacity:_pageSize];
+        for (NSUInteger index = pageNumber * _pageSize; index < MIN((pageNumber + 1) * _pageSize, _count); index++) {
+            [nulls addObject:[NSNull null]];
+        }
+        return nulls;
+    }
+    
+    pthread_mutex_lock(&_lock);
+    for (NSUInteger number = pageNumber; number <= lastPageNumber; number++) {
+        NSUInteger pageStart = (number - pageNumber) * _pageSize;
+        NSArray *readPage = [objects subarrayWithRange:NSMakeRange(pageStart, MIN(_pageSize, objects.count - pageStart))];
+        
+        // another thread may have read the same page while we were reading it, and the first one wins
+        if (_pages[@(number)] == nil) {
+            _pages[@(number)] = readPage;
+        }
+        [self _didUsePage:number];
+    }
+    
+    // the requested page was used last, so it is the last to be dropped
+    [self _didUsePage:pageNumber];
+    page = _pages[@(pageNumber)];
+    
+    while (_pageOrder.count > TNKCachedPageCount + _prefetchPageCount) {
+        [_pages removeObjectForKey:_pageOrder.firstObject];
+        [_pageOrder removeObjectAtIndex:0];
+    }
+    pthread_mutex_unlock(&_lock);
+    
+    return page;
+}
+
+// must be called while holding _lock
+- (void)_didUsePage:(NSUInteger)pageNumber
+{
+    [_pageOrder removeObject:@(pageNumber)];
+    [_pageOrder addObject:@(pageNumber)];
+}
+
+@end
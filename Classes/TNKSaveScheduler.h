@@ -0,0 +1,80 @@
+//
+//  TNKSaveScheduler.h
+//  Pods
+//
+//  Created by David Beck on 7/22/14.
+//
+//
+
+#import <Foundation/Foundation.h>
+
+@class TNKConnection;
+
+
+/** Decides when a connection saves it's changes automatically
+ 
+ A save scheduler uses a timer on it's own queue, so automatic saves don't depend on the main thread or a run loop. The first
+ change after a save starts a window of `interval` seconds. If changes are still coming in when the window ends, the window is
+ extended in steps, so that a burst of changes is saved together, but never past `maximumInterval` seconds after the first change.
+ When saves start taking longer, the window is widened to match, so that a slow database isn't saved more often than it can keep
+ up with.
+ 
+ The window also adapts to how often changes are made. When fewer than one change is expected per `interval`, the window is
+ stretched towards `maximumInterval`, so that light traffic makes fewer commits. When the connection's `pendingChangeCount` or
+ `estimatedPendingBytes` pass `maximumPendingChangeCount` or `maximumPendingBytes`, the changes are saved right away, so that bulk
+ edits don't build up an unbounded amount of memory or a huge transaction.
+ 
+ Each connection creates a scheduler when it is created. You can replace it with your own subclass to change when saves happen.
+ */
+@interface TNKSaveScheduler : NSObject
+
+/** Create a scheduler for a connection
+ 
+ @param connection The connection to save. It is not retained.
+ @return A new save scheduler.
+ */
+- (instancetype)initWithConnection:(TNKConnection *)connection;
+
+/** The connection that is saved.
+ */
+@property (nonatomic, weak, readonly) TNKConnection *connection;
+
+/** The shortest time to wait after a change before saving.
+ 
+ 1 second by default.
+ */
+@property (atomic) NSTimeInterval interval;
+
+/** The longest time to wait after a change before saving, no matter how many changes keep coming in.
+ 
+ 5 seconds by default.
+ */
+@property (atomic) NSTimeInterval maximumInterval;
+
+/** The number of pending changes that triggers a save without waiting for the window to end.
+ 
+ 10000 by default.
+ */
+@property (atomic) NSUInteger maximumPendingChangeCount;
+
+/** The estimated size of the pending changes, in bytes, that triggers a save without waiting for the window to end.
+ 
+ 8MB by default.
+ */
+@property (atomic) NSUInteger maximumPendingBytes;
+
+/** Tell the scheduler that the connection has unsaved changes
+ 
+ This is called by the connection for every change, so it should return quickly.
+ */
+- (void)setNeedsSave;
+
+/** Save any pending changes now, instead of waiting for the window to end
+ 
+ The save is made on the scheduler's queue, and this returns immediately.
+ 
+ @param completion Called on the scheduler's queue after the save, or right away if there was nothing to save. May be nil.
+ */
+- (void)triggerSaveWithCompletion:(void(^)())completion;
+
+@end
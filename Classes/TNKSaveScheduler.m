@@ -0,0 +1,176 @@
+//
+//  TNKSaveScheduler.m
+//  Pods
+//
+//  Created by David Beck on 7/22/14.
+//
+//
+
+#import "TNKSaveScheduler.h"
+
+#import <libkern/OSAtomic.h>
+
+#import "TNKConnection_Private.h"
+
+
+@interface TNKSaveScheduler ()
+{
+    dispatch_queue_t _queue;
+    dispatch_source_t _timer;
+    
+    volatile int32_t _pending;
+    volatile int32_t _earlySavePending;
+    // written on every change without a lock, so it is only used as a hint
+    volatile CFAbsoluteTime _lastChangeTime;
+    
+    // only used on _queue
+    CFAbsoluteTime _firstChangeTime;
+    CFAbsoluteTime _lastSaveTime;
+    NSTimeInterval _lastSaveDuration;
+    // changes per second, averaged over the last few saves, or negative before the first save
+    double _changeRate;
+}
+
+@end
+
+@implementation TNKSaveScheduler
+
+- (instancetype)init
+{
+    NSAssert(NO, @"You cannot call init on TNKSaveScheduler without a connection.");
+    return nil;
+}
+
+- (instancetype)initWithConnection:(TNKConnection *)connection
+{
+    self = [super init];
+    if (self) {
+        _connection = connection;
+        _interval = 1.0;
+        _maximumInterval = 5.0;
+        _maximumPendingChangeCount = 10000;
+        _maximumPendingBytes = 8 * 1024 * 1024;
+        
+        _lastSaveTime = CFAbsoluteTimeGetCurrent();
+        _changeRate = -1.0;
+        
+        _queue = dispatch_queue_create("TNKSaveScheduler", DISPATCH_QUEUE_SERIAL);
+        dispatch_set_target_queue(_queue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0));
+        
+        __weak TNKSaveScheduler *weakSelf = self;
+        _timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _queue);
+        dispatch_source_set_event_handler(_timer, ^{
+            [weakSelf _timerDidFire];
+        });
+        dispatch_source_set_timer(_timer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+        dispatch_resume(_timer);
+    }
+    
+    return self;
+}
+
+- (void)dealloc
+{
+    dispatch_source_cancel(_timer);
+}
+
+- (void)setNeedsSave
+{
+    _lastChangeTime = CFAbsoluteTimeGetCurrent();
+    
+    // only the first change after a save starts a window
+    if (OSAtomicCompareAndSwap32Barrier(0, 1, &_pending)) {
+        dispatch_async(_queue, ^{
+            _firstChangeTime = CFAbsoluteTimeGetCurrent();
+            [self _fireAfter:[self _window]];
+        });
+    }
+    
+    TNKConnection *connection = self.connection;
+    if (connection.pendingChangeCount >= self.maximumPendingChangeCount || connection.estimatedPendingBytes >= self.maximumPendingBytes) {
+        // further changes made before the early save finishes don't need one of their own
+        if (OSAtomicCompareAndSwap32Barrier(0, 1, &_earlySavePending)) {
+            dispatch_async(_queue, ^{
+                [self _save];
+            });
+        }
+    }
+}
+
+- (void)triggerSaveWithCompletion:(void(^)())completion
+{
+    dispatch_async(_queue, ^{
+        [self _save];
+        
+        if (completion != nil) {
+            completion();
+        }
+    });
+}
+
+
+#pragma mark - Timer
+
+// must be called on _queue
+- (NSTimeInterval)_window
+{
+    NSTimeInterval interval = self.interval;
+    NSTimeInterval maximumInterval = MAX(self.maximumInterval, interval);
+    
+    // when changes are rare, wait long enough that a save is likely to group more than one of them
+    double expectedChangeCount = _changeRate * interval;
+    if (_changeRate >= 0.0 && expectedChangeCount < 1.0 && interval > 0.0) {
+        interval = interval / MAX(expectedChangeCount, interval / maximumInterval);
+    }
+    
+    // a save shouldn't take more than a quarter of the time between saves
+    return MIN(MAX(interval, _lastSaveDuration * 4.0), maximumInterval);
+}
+
+// must be called on _queue
+- (void)_fireAfter:(NSTimeInterval)delay
+{
+    uint64_t nanoseconds = (uint64_t)(delay * NSEC_PER_SEC);
+    dispatch_source_set_timer(_timer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)nanoseconds), DISPATCH_TIME_FOREVER, nanoseconds / 10);
+}
+
+- (void)_timerDidFire
+{
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    NSTimeInterval step = [self _window] / 4.0;
+    
+    // changes are still coming in, so wait for the burst to end, as long as we don't go past the maximum
+    if (now - _lastChangeTime < step && now + step - _firstChangeTime <= MAX(self.maximumInterval, self.interval)) {
+        [self _fireAfter:step];
+        return;
+    }
+    
+    [self _save];
+}
+
+// must be called on _queue
+- (void)_save
+{
+    dispatch_source_set_timer(_timer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+    
+    // changes made after this start a new window
+    OSAtomicCompareAndSwap32Barrier(1, 0, &_pending);
+    
+    TNKConnection *connection = self.connection;
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    
+    NSTimeInterval elapsed = start - _lastSaveTime;
+    if (elapsed > 0.0) {
+        double changeRate = connection.pendingChangeCount / elapsed;
+        _changeRate = _changeRate < 0.0 ? changeRate : (_changeRate + changeRate) / 2.0;
+    }
+    
+    [connection autosave];
+    
+    _lastSaveTime = CFAbsoluteTimeGetCurrent();
+    _lastSaveDuration = _lastSaveTime - start;
+    
+    OSAtomicCompareAndSwap32Barrier(1, 0, &_earlySavePending);
+}
+
+@end
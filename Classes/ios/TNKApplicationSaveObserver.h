@@ -0,0 +1,34 @@
+//
+//  TNKApplicationSaveObserver.h
+//  Pods
+//
+//  Created by David Beck on 7/22/14.
+//
+//
+
+#import <Foundation/Foundation.h>
+
+@class TNKConnection;
+
+
+/** Saves a connection when an iOS app resigns active or enters the background
+ 
+ The save is triggered through the connection's `saveScheduler`, inside of a background task that ends when the save finishes, so
+ that the app isn't suspended in the middle of a save.
+ 
+ Connections create one of these automatically unless `TNKConnectionObservesApplicationOption` is turned off.
+ */
+@interface TNKApplicationSaveObserver : NSObject
+
+/** Start observing the app for a connection
+ 
+ @param connection The connection to save. It is not retained.
+ @return A new observer, which stops observing when it is deallocated.
+ */
+- (instancetype)initWithConnection:(TNKConnection *)connection;
+
+/** The connection that is saved.
+ */
+@property (nonatomic, weak, readonly) TNKConnection *connection;
+
+@end
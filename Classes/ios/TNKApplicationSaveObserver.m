@@ -0,0 +1,77 @@
+//
+//  TNKApplicationSaveObserver.m
+//  Pods
+//
+//  Created by David Beck on 7/22/14.
+//
+//
+
+#import "TNKApplicationSaveObserver.h"
+
+#import <UIKit/UIKit.h>
+
+#import "TNKConnection.h"
+#import "TNKSaveScheduler.h"
+
+
+@implementation TNKApplicationSaveObserver
+
+- (instancetype)init
+{
+    NSAssert(NO, @"You cannot call init on TNKApplicationSaveObserver without a connection.");
+    return nil;
+}
+
+- (instancetype)initWithConnection:(TNKConnection *)connection
+{
+    self = [super init];
+    if (self) {
+        _connection = connection;
+        
+        NSNotificationCenter *notificationCenter = [NSNotificationCenter defaultCenter];
+        [notificationCenter addObserver:self selector:@selector(applicationWillResignActive:) name:UIApplicationWillResignActiveNotification object:nil];
+        [notificationCenter addObserver:self selector:@selector(applicationDidEnterBackground:) name:UIApplicationDidEnterBackgroundNotification object:nil];
+    }
+    
+    return self;
+}
+
+- (void)dealloc
+{
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+}
+
+- (void)_saveInBackgroundTask
+{
+    UIApplication *application = [UIApplication sharedApplication];
+    
+    // the task is only ever read and ended on the main queue
+    __block UIBackgroundTaskIdentifier saveTask = UIBackgroundTaskInvalid;
+    void(^endSaveTask)() = ^{
+        if (saveTask != UIBackgroundTaskInvalid) {
+            [application endBackgroundTask:saveTask];
+            saveTask = UIBackgroundTaskInvalid;
+        }
+    };
+    
+    saveTask = [application beginBackgroundTaskWithName:@"TNKConnection-save" expirationHandler:endSaveTask];
+    
+    [self.connection.saveScheduler triggerSaveWithCompletion:^{
+        dispatch_async(dispatch_get_main_queue(), endSaveTask);
+    }];
+}
+
+
+#pragma mark - Notifications
+
+- (void)applicationWillResignActive:(NSNotification *)notification
+{
+    [self _saveInBackgroundTask];
+}
+
+- (void)applicationDidEnterBackground:(NSNotification *)notification
+{
+    [self _saveInBackgroundTask];
+}
+
+@end
@@ -0,0 +1 @@
+../../../../Classes/NSSortDescriptor+TNKOrderClause.h
\ No newline at end of file
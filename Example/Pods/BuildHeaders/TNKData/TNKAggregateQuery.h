@@ -0,0 +1 @@
+../../../../Classes/TNKAggregateQuery.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../../Classes/ios/TNKApplicationSaveObserver.h
\ No newline at end of file
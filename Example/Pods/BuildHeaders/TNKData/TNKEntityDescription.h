@@ -0,0 +1 @@
+../../../../Classes/TNKEntityDescription.h
\ No newline at end of file
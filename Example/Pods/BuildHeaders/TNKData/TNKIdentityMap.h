@@ -0,0 +1 @@
+../../../../Classes/TNKIdentityMap.h
\ No newline at end of file
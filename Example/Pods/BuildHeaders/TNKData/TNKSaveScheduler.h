@@ -0,0 +1 @@
+../../../../Classes/TNKSaveScheduler.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../../Classes/TNKCheckpointer.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../../Classes/TNKPagedArray.h
\ No newline at end of file
@@ -11,6 +11,7 @@
 #import <TNKData/TNKData.h>
 #import <TNKData/TNKConnection_Private.h>
 #import <FMDB/FMDatabase.h>
+#import <FMDB/FMDatabaseAdditions.h>
 
 #import "TNKTestObject.h"
 
@@ -18,6 +19,8 @@
 @interface TNKDataDemoTests : XCTestCase
 {
     TNKConnection *_connection;
+    // file databases made by the test, removed in tearDown
+    NSMutableArray *_temporaryURLs;
 }
 
 @end
@@ -29,14 +32,35 @@
     [super setUp];
     
     _connection = [TNKConnection connectionWithURL:nil classes:[NSSet setWithObject:[TNKTestObject class]]];
+    _temporaryURLs = [NSMutableArray new];
 }
 
 - (void)tearDown
 {
-    // Put teardown code here. This method is called after the invocation of each test method in the class.
+    for (NSURL *URL in _temporaryURLs) {
+        for (NSString *suffix in @[ @"", @"-wal", @"-shm" ]) {
+            [[NSFileManager defaultManager] removeItemAtPath:[URL.path stringByAppendingString:suffix] error:NULL];
+        }
+    }
+    
     [super tearDown];
 }
 
+// in memory databases read through the writer, so the reader pool and checkpoints need a file database
+- (NSURL *)temporaryDatabaseURL
+{
+    NSString *name = [NSString stringWithFormat:@"TNKDataTests-%@.sqlite", [[NSUUID UUID] UUIDString]];
+    NSURL *URL = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:name]];
+    [_temporaryURLs addObject:URL];
+    
+    return URL;
+}
+
+- (TNKConnection *)fileConnection
+{
+    return [TNKConnection connectionWithURL:[self temporaryDatabaseURL] classes:[NSSet setWithObject:[TNKTestObject class]]];
+}
+
 - (void)testTableCreation
 {
     [_connection.databaseQueue inDatabase:^(FMDatabase *db) {
@@ -145,4 +169,675 @@
     }];
 }
 
+- (void)testFaultedValuesLeaveOutNil
+{
+    [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+        TNKTestObject *object = [TNKTestObject insertObjectWithInitialization:^(TNKTestObject *object) {
+            object.stringProperty = nil;
+            object.intProperty = 1;
+        }];
+        
+        XCTAssertNil(object.faultedValues[@"stringProperty"], @"Faulted nil values should be left out.");
+        XCTAssertEqualObjects(object.faultedValues[@"intProperty"], @1, @"Faulted values should be included.");
+        XCTAssertTrue([object.description rangeOfString:@"stringProperty=(fault)"].location != NSNotFound, @"Nil values should be described as faults.");
+    }];
+}
+
+- (void)testObjectIDAllocation
+{
+    [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+        TNKTestObject *first = [TNKTestObject insertObjectWithInitialization:nil];
+        TNKTestObject *second = [TNKTestObject insertObjectWithInitialization:nil];
+        
+        XCTAssertNotEqual(first.objectID, 0, @"Inserted objects should be assigned an objectID.");
+        XCTAssertEqual(second.objectID, first.objectID + 1, @"objectIDs should be allocated consecutively.");
+        XCTAssertEqual([TNKTestObject findByServerID:first.objectID], first, @"Inserted objects should be found by objectID before saving.");
+        
+        [connection save];
+        
+        XCTAssertEqual([TNKTestObject findByServerID:second.objectID], second, @"Inserted objects should be found by objectID after saving.");
+    }];
+}
+
+- (void)testObjectIDsAcrossConnections
+{
+    NSURL *URL = [self temporaryDatabaseURL];
+    NSSet *classes = [NSSet setWithObject:[TNKTestObject class]];
+    TNKConnection *firstConnection = [TNKConnection connectionWithURL:URL classes:classes];
+    TNKConnection *secondConnection = [TNKConnection connectionWithURL:URL classes:classes];
+    
+    __block TNKTestObject *firstObject = nil;
+    [TNKConnection useConnection:firstConnection block:^(TNKConnection *connection) {
+        firstObject = [TNKTestObject insertObjectWithInitialization:nil];
+    }];
+    __block TNKTestObject *secondObject = nil;
+    [TNKConnection useConnection:secondConnection block:^(TNKConnection *connection) {
+        secondObject = [TNKTestObject insertObjectWithInitialization:nil];
+    }];
+    XCTAssertEqual(firstObject.objectID, secondObject.objectID, @"Both connections should start from the same largest objectID.");
+    
+    [firstConnection save];
+    XCTAssertTrue([secondConnection saveWithDurability:TNKSaveDurabilityFull chunkHandler:nil], @"Saves should move objects off of ids that another connection used.");
+    XCTAssertNotEqual(secondObject.objectID, firstObject.objectID, @"The object that was saved second should get a new objectID.");
+    
+    [TNKConnection useConnection:secondConnection block:^(TNKConnection *connection) {
+        XCTAssertEqual([TNKTestObject findByServerID:secondObject.objectID], secondObject, @"Moved objects should be found by their new objectID.");
+        XCTAssertGreaterThan([TNKTestObject insertObjectWithInitialization:nil].objectID, secondObject.objectID, @"The allocator should be moved past ids used by other connections.");
+    }];
+    
+    [secondConnection.databaseQueue inDatabase:^(FMDatabase *db) {
+        XCTAssertEqual([db intForQuery:[NSString stringWithFormat:@"SELECT COUNT(*) FROM %@", [TNKTestObject class]]], 2, @"Both objects should be saved.");
+    }];
+}
+
+- (void)testQueryReturnsRegisteredObjects
+{
+    [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+        TNKTestObject *object = [TNKTestObject insertObjectWithInitialization:^(TNKTestObject *object) {
+            object.stringProperty = @"Testing";
+        }];
+        [connection save];
+        
+        TNKObjectQuery *query = [[TNKObjectQuery alloc] initWithObjectClass:[TNKTestObject class]];
+        query.predicate = [NSPredicate predicateWithFormat:@"stringProperty == 'Testing'"];
+        NSArray *objects = [query run];
+        
+        XCTAssertEqual(objects.count, 1, @"The query should return the inserted object.");
+        XCTAssertEqual(objects.firstObject, object, @"Queries should return the registered instance of an object.");
+        XCTAssertEqual([connection existingObjectWithClass:[TNKTestObject class] primaryValues:@{ @"objectID": @(object.objectID) }], object, @"Registered objects should be found by their primary values.");
+    }];
+}
+
+- (void)testSaveDurability
+{
+    [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+        TNKTestObject *object = [TNKTestObject insertObjectWithInitialization:nil];
+        [connection saveWithDurability:TNKSaveDurabilityRelaxed];
+        
+        object.stringProperty = @"Testing";
+        [connection saveWithDurability:TNKSaveDurabilityGroupCommit];
+        
+        [connection.databaseQueue inDatabase:^(FMDatabase *db) {
+            XCTAssertEqualObjects([db stringForQuery:[NSString stringWithFormat:@"SELECT stringProperty FROM %@ WHERE objectID = ?", [TNKTestObject class]], @(object.objectID)], @"Testing", @"Saves with any durability should be written.");
+            XCTAssertEqual([db intForQuery:@"PRAGMA synchronous"], 2, @"The synchronous level should be restored after a save.");
+        }];
+    }];
+}
+
+- (void)testSaveScheduler
+{
+    [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+        [TNKTestObject insertObjectWithInitialization:nil];
+    }];
+    
+    // the main thread is blocked, so the save can't depend on it
+    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    [_connection.saveScheduler triggerSaveWithCompletion:^{
+        dispatch_semaphore_signal(semaphore);
+    }];
+    dispatch_semaphore_wait(semaphore, dispatch_time(DISPATCH_TIME_NOW, 5 * NSEC_PER_SEC));
+    
+    XCTAssertEqual(_connection.insertedObjects.count, 0, @"A triggered save should save pending changes off of the main thread.");
+    XCTAssertEqual(_connection.saveInterval, _connection.saveScheduler.interval, @"The save interval should be the scheduler's interval.");
+}
+
+- (void)testEarlySave
+{
+    _connection.saveInterval = 60.0;
+    _connection.saveScheduler.maximumInterval = 60.0;
+    _connection.saveScheduler.maximumPendingChangeCount = 10;
+    
+    [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+        for (NSUInteger index = 0; index < 9; index++) {
+            [TNKTestObject insertObjectWithInitialization:nil];
+        }
+        XCTAssertEqual(connection.pendingChangeCount, 9, @"Each insert should be counted as a pending change.");
+        XCTAssertGreaterThan(connection.estimatedPendingBytes, 0, @"Pending changes should have an estimated size.");
+        
+        [TNKTestObject insertObjectWithInitialization:nil];
+    }];
+    
+    NSDate *timeout = [NSDate dateWithTimeIntervalSinceNow:5.0];
+    while (_connection.pendingChangeCount > 0 && [timeout timeIntervalSinceNow] > 0) {
+        usleep(10000);
+    }
+    
+    XCTAssertEqual(_connection.pendingChangeCount, 0, @"Passing the pending change limit should save without waiting for the interval.");
+    XCTAssertEqual(_connection.estimatedPendingBytes, 0, @"A save should clear the estimated size of the pending changes.");
+}
+
+- (void)testChunkedSave
+{
+    _connection.maximumChangesPerTransaction = 10;
+    
+    [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+        for (NSUInteger index = 0; index < 25; index++) {
+            [TNKTestObject insertObjectWithInitialization:nil];
+        }
+        
+        __block NSUInteger chunkCount = 0;
+        __block NSUInteger objectCount = 0;
+        BOOL success = [connection saveWithDurability:TNKSaveDurabilityFull chunkHandler:^(NSSet *objects, NSError *error) {
+            XCTAssertNil(error, @"Each chunk should be saved.");
+            XCTAssertLessThanOrEqual(objects.count, 10, @"Chunks should be limited to maximumChangesPerTransaction.");
+            chunkCount++;
+            objectCount += objects.count;
+            
+            // would deadlock if the handler were called while the save was in progress
+            XCTAssertTrue([connection saveWithDurability:TNKSaveDurabilityFull chunkHandler:nil], @"The handler should be able to save the connection.");
+        }];
+        
+        XCTAssertTrue(success, @"A save should succeed when every chunk is saved.");
+        XCTAssertEqual(chunkCount, 3, @"A save should be split into chunks.");
+        XCTAssertEqual(objectCount, 25, @"Every change should be in a chunk.");
+        
+        [connection.databaseQueue inDatabase:^(FMDatabase *db) {
+            XCTAssertEqual([db intForQuery:[NSString stringWithFormat:@"SELECT COUNT(*) FROM %@", [TNKTestObject class]]], 25, @"Every chunk should be committed.");
+        }];
+    }];
+}
+
+- (void)testChangesClearedAfterSave
+{
+    [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+        TNKTestObject *object = [TNKTestObject insertObjectWithInitialization:^(TNKTestObject *object) {
+            object.stringProperty = @"Testing";
+        }];
+        [connection save];
+        
+        XCTAssertEqual(object.changedValues.count, 0, @"A save should clear the changed values.");
+        
+        object.intProperty = 5;
+        XCTAssertEqualObjects(object.changedValues, @{ @"intProperty": @5 }, @"Only changes since the last save should be tracked.");
+        
+        [connection save];
+        XCTAssertEqual(object.changedValues.count, 0, @"A save should clear the changed values.");
+    }];
+}
+
+- (void)testNoOpChanges
+{
+    [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+        TNKTestObject *object = [TNKTestObject insertObjectWithInitialization:^(TNKTestObject *object) {
+            object.stringProperty = @"Testing";
+            object.intProperty = 5;
+        }];
+        [connection save];
+        
+        object.stringProperty = @"Testing";
+        object.intProperty = 5;
+        XCTAssertFalse(object.isUpdated, @"Setting a property to it's current value shouldn't be a change.");
+        XCTAssertEqual(connection.updatedObjects.count, 0, @"Setting a property to it's current value shouldn't queue an update.");
+        
+        TNKTestObject *deletedObject = [TNKTestObject insertObjectWithInitialization:nil];
+        [deletedObject deleteObject];
+        
+        __block NSUInteger objectCount = 0;
+        [connection saveWithDurability:TNKSaveDurabilityFull chunkHandler:^(NSSet *objects, NSError *error) {
+            objectCount += objects.count;
+        }];
+        XCTAssertEqual(objectCount, 0, @"An object inserted and deleted before a save shouldn't be written.");
+    }];
+}
+
+- (void)testBulkChanges
+{
+    [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+        TNKTestObject *expiredObject = [TNKTestObject insertObjectWithInitialization:^(TNKTestObject *object) {
+            object.intProperty = 1;
+        }];
+        TNKTestObject *keptObject = [TNKTestObject insertObjectWithInitialization:^(TNKTestObject *object) {
+            object.intProperty = 2;
+        }];
+        
+        NSUInteger count = [TNKTestObject updateObjectsMatchingPredicate:[NSPredicate predicateWithFormat:@"intProperty == 2"] values:@{ @"stringProperty": @"Kept" }];
+        XCTAssertEqual(count, 1, @"Only matching rows should be updated.");
+        XCTAssertEqualObjects(keptObject.stringProperty, @"Kept", @"Registered objects should get the updated values.");
+        XCTAssertFalse(keptObject.isUpdated, @"Updated values are already saved.");
+        
+        count = [TNKTestObject deleteObjectsMatchingPredicate:[NSPredicate predicateWithFormat:@"intProperty == 1"]];
+        XCTAssertEqual(count, 1, @"Only matching rows should be deleted.");
+        XCTAssertTrue(expiredObject.isDeleted, @"Registered objects should be marked as deleted.");
+        XCTAssertFalse(keptObject.isDeleted, @"Objects that don't match shouldn't be deleted.");
+        XCTAssertNil([connection existingObjectWithClass:[TNKTestObject class] primaryValues:@{ @"objectID": @(expiredObject.objectID) }], @"Deleted objects should be removed from the identity map.");
+        
+        [connection.databaseQueue inDatabase:^(FMDatabase *db) {
+            XCTAssertEqual([db intForQuery:[NSString stringWithFormat:@"SELECT COUNT(*) FROM %@", [TNKTestObject class]]], 1, @"The matching row should be deleted.");
+        }];
+    }];
+}
+
+- (void)testSortAndLimit
+{
+    [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+        for (int index = 0; index < 5; index++) {
+            [TNKTestObject insertObjectWithInitialization:^(TNKTestObject *object) {
+                object.intProperty = index;
+            }];
+        }
+        [connection save];
+        
+        TNKObjectQuery *query = [[TNKObjectQuery alloc] initWithObjectClass:[TNKTestObject class]];
+        XCTAssertEqual([query run].count, 5, @"A query without a predicate should return every object.");
+        
+        query.sortDescriptors = @[ [NSSortDescriptor sortDescriptorWithKey:@"intProperty" ascending:NO] ];
+        query.limit = 2;
+        query.offset = 1;
+        XCTAssertEqualObjects([[query run] valueForKey:@"intProperty"], (@[ @3, @2 ]), @"The results should be sorted, offset and limited.");
+    }];
+}
+
+- (void)testEnumerateObjects
+{
+    [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+        for (int index = 0; index < 250; index++) {
+            [TNKTestObject insertObjectWithInitialization:^(TNKTestObject *object) {
+                object.intProperty = index;
+            }];
+        }
+        [connection save];
+        
+        TNKObjectQuery *query = [[TNKObjectQuery alloc] initWithObjectClass:[TNKTestObject class]];
+        query.sortDescriptors = @[ [NSSortDescriptor sortDescriptorWithKey:@"intProperty" ascending:YES] ];
+        query.fetchBatchSize = 100;
+        
+        __block int count = 0;
+        [query enumerateObjectsWithBlock:^(TNKTestObject *object, BOOL *stop) {
+            XCTAssertEqual(object.intProperty, count, @"Objects should be enumerated in order.");
+            count++;
+            *stop = count == 150;
+        }];
+        XCTAssertEqual(count, 150, @"Enumeration should stop when asked to.");
+    }];
+}
+
+- (void)testPagedResults
+{
+    [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+        for (int index = 0; index < 250; index++) {
+            [TNKTestObject insertObjectWithInitialization:^(TNKTestObject *object) {
+                object.intProperty = index;
+            }];
+        }
+        [connection save];
+        
+        TNKObjectQuery *query = [[TNKObjectQuery alloc] initWithObjectClass:[TNKTestObject class]];
+        query.sortDescriptors = @[ [NSSortDescriptor sortDescriptorWithKey:@"intProperty" ascending:YES] ];
+        query.fetchBatchSize = 20;
+        query.returnsPagedResults = YES;
+        
+        NSArray *results = [query run];
+        XCTAssertTrue([results isKindOfClass:[TNKPagedArray class]], @"Paged queries should return a paged array.");
+        XCTAssertEqual(results.count, 250, @"A paged array should know it's count before reading any objects.");
+        XCTAssertEqual([results[0] intProperty], 0, @"Pages should be read in order.");
+        XCTAssertEqual([results[135] intProperty], 135, @"Pages should be read in order.");
+        XCTAssertEqual([results.lastObject intProperty], 249, @"The last page should be read.");
+        
+        query.predicate = [NSPredicate predicateWithFormat:@"intProperty < 0"];
+        XCTAssertThrowsSpecificNamed([query run][0], NSException, NSRangeException, @"Empty paged arrays should raise a range exception.");
+    }];
+}
+
+- (void)testLargePages
+{
+    [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+        for (int index = 0; index < 1200; index++) {
+            [TNKTestObject insertObjectWithInitialization:^(TNKTestObject *object) {
+                object.intProperty = index;
+            }];
+        }
+        [connection save];
+        
+        // one page is read in several statements
+        TNKObjectQuery *query = [[TNKObjectQuery alloc] initWithObjectClass:[TNKTestObject class]];
+        query.sortDescriptors = @[ [NSSortDescriptor sortDescriptorWithKey:@"intProperty" ascending:YES] ];
+        query.fetchBatchSize = 1200;
+        query.returnsPagedResults = YES;
+        
+        NSArray *results = [query run];
+        XCTAssertEqual([results[0] intProperty], 0, @"Pages should be read in order.");
+        XCTAssertEqual([results[700] intProperty], 700, @"Rows past the first statement should be read.");
+        XCTAssertEqual([results.lastObject intProperty], 1199, @"Rows in the last statement should be read.");
+    }];
+}
+
+- (void)testPagedResultsDontChangeCurrentConnection
+{
+    __block NSArray *results = nil;
+    [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+        [TNKTestObject insertObjectWithInitialization:nil];
+        [connection save];
+        
+        TNKObjectQuery *query = [[TNKObjectQuery alloc] initWithObjectClass:[TNKTestObject class]];
+        query.returnsPagedResults = YES;
+        results = [query run];
+    }];
+    
+    XCTAssertNil([NSThread currentThread].threadDictionary[@"TNKCurrentConnection"], @"useConnection:block: should not leave it's connection behind.");
+    
+    dispatch_sync(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        TNKConnection *currentConnection = [TNKConnection currentConnection];
+        XCTAssertNotNil(results.firstObject, @"Paged arrays should read from their own connection.");
+        XCTAssertEqual([TNKConnection currentConnection], currentConnection, @"Reading a page should not change the thread's current connection.");
+    });
+}
+
+- (void)testAggregateQuery
+{
+    [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+        for (int index = 0; index < 10; index++) {
+            [TNKTestObject insertObjectWithInitialization:^(TNKTestObject *object) {
+                object.intProperty = index;
+                object.stringProperty = index % 2 == 0 ? @"Even" : @"Odd";
+            }];
+        }
+        [connection save];
+        
+        TNKAggregateQuery *countQuery = [[TNKAggregateQuery alloc] initWithObjectClass:[TNKTestObject class]];
+        countQuery.predicate = [NSPredicate predicateWithFormat:@"intProperty >= 4"];
+        XCTAssertEqualObjects([countQuery runScalar], @6, @"Counts should only include matching rows.");
+        
+        TNKAggregateQuery *groupQuery = [[TNKAggregateQuery alloc] initWithObjectClass:[TNKTestObject class]];
+        groupQuery.groupByKeys = @[ @"stringProperty" ];
+        [groupQuery addAggregateFunction:TNKAggregateFunctionSum forKey:@"intProperty" resultKey:@"sum"];
+        [groupQuery addAggregateFunction:TNKAggregateFunctionMaximum forKey:@"intProperty" resultKey:@"max"];
+        
+        NSArray *results = [groupQuery run];
+        XCTAssertEqual(results.count, 2, @"Each group should have a result.");
+        NSDictionary *even = [[results filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"stringProperty == 'Even'"]] firstObject];
+        XCTAssertEqualObjects(even[@"sum"], @20, @"Sums should be computed per group.");
+        XCTAssertEqualObjects(even[@"max"], @8, @"Maximums should be computed per group.");
+    }];
+}
+
+- (void)testDictionaryResults
+{
+    [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+        for (int index = 0; index < 6; index++) {
+            [TNKTestObject insertObjectWithInitialization:^(TNKTestObject *object) {
+                object.intProperty = index;
+                object.stringProperty = index % 2 == 0 ? @"Even" : @"Odd";
+            }];
+        }
+        [connection save];
+        
+        TNKObjectQuery *query = [[TNKObjectQuery alloc] initWithObjectClass:[TNKTestObject class]];
+        query.resultType = TNKObjectQueryResultTypeDictionaries;
+        query.keysToFetch = [NSSet setWithObjects:@"intProperty", @"stringProperty", nil];
+        query.sortDescriptors = @[ [NSSortDescriptor sortDescriptorWithKey:@"intProperty" ascending:YES] ];
+        
+        NSArray *results = [query run];
+        XCTAssertEqual(results.count, 6, @"Each row should have a dictionary.");
+        XCTAssertEqualObjects(results[3], (@{ @"intProperty": @3, @"stringProperty": @"Odd" }), @"Dictionaries should only have the keys to fetch.");
+        
+        query.fetchBatchSize = 2;
+        NSMutableArray *enumerated = [NSMutableArray new];
+        [query enumerateObjectsWithBlock:^(NSDictionary *row, BOOL *stop) {
+            [enumerated addObject:row];
+            *stop = enumerated.count == 5;
+        }];
+        XCTAssertEqualObjects(enumerated, [results subarrayWithRange:NSMakeRange(0, 5)], @"Dictionaries should be enumerated in batches, in order, until stopped.");
+        
+        query.resultType = TNKObjectQueryResultTypeValues;
+        query.keysToFetch = [NSSet setWithObject:@"stringProperty"];
+        query.sortDescriptors = @[ [NSSortDescriptor sortDescriptorWithKey:@"stringProperty" ascending:YES] ];
+        query.returnsDistinctResults = YES;
+        XCTAssertEqualObjects([query run], (@[ @"Even", @"Odd" ]), @"Distinct values should only include each value once.");
+    }];
+}
+
+- (void)testReadSnapshot
+{
+    TNKConnection *fileConnection = [self fileConnection];
+    [TNKConnection useConnection:fileConnection block:^(TNKConnection *connection) {
+        [TNKTestObject insertObjectWithInitialization:^(TNKTestObject *object) {
+            object.stringProperty = @"Testing";
+        }];
+        [connection save];
+    }];
+    
+    TNKObjectQuery *query = [[TNKObjectQuery alloc] initWithObjectClass:[TNKTestObject class]];
+    query.predicate = [NSPredicate predicateWithFormat:@"stringProperty == 'Testing'"];
+    
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    dispatch_sync(queue, ^{
+        [fileConnection performReadSnapshot:^(TNKConnection *connection) {
+            XCTAssertEqual([TNKConnection currentConnection], fileConnection, @"The snapshot's connection should be the current connection.");
+            XCTAssertEqual([query run].count, 1, @"Queries in a snapshot should see saved objects.");
+            
+            // committed on another thread, which doesn't share the snapshot
+            dispatch_group_t group = dispatch_group_create();
+            dispatch_group_async(group, queue, ^{
+                [TNKConnection useConnection:fileConnection block:^(TNKConnection *connection) {
+                    [TNKTestObject insertObjectWithInitialization:^(TNKTestObject *object) {
+                        object.stringProperty = @"Testing";
+                    }];
+                    [connection save];
+                }];
+            });
+            dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+            
+            XCTAssertEqual([query run].count, 1, @"Queries in a snapshot should not see saves made after it started.");
+        }];
+        
+        XCTAssertNil([NSThread currentThread].threadDictionary[@"TNKCurrentConnection"], @"A snapshot should not leave it's connection as the thread's current connection.");
+    });
+    
+    [TNKConnection useConnection:fileConnection block:^(TNKConnection *connection) {
+        XCTAssertEqual([query run].count, 2, @"Queries after a snapshot should see the latest save.");
+    }];
+}
+
+- (void)testReaderPoolQueries
+{
+    TNKConnection *fileConnection = [self fileConnection];
+    
+    [TNKConnection useConnection:fileConnection block:^(TNKConnection *connection) {
+        for (NSString *string in @[ @"item 10", @"Item 2", @"item 1", @"testïng" ]) {
+            [TNKTestObject insertObjectWithInitialization:^(TNKTestObject *object) {
+                object.stringProperty = string;
+            }];
+        }
+        [connection save];
+        
+        [connection performRead:^(FMDatabase *db) {
+            XCTAssertEqual(sqlite3_db_readonly(db.sqliteHandle, "main"), 1, @"File databases should read from the read only pool.");
+        }];
+        
+        TNKObjectQuery *query = [[TNKObjectQuery alloc] initWithObjectClass:[TNKTestObject class]];
+        query.predicate = [NSPredicate predicateWithFormat:@"stringProperty MATCHES '[Ii]tem [0-9]$'"];
+        XCTAssertEqual([query run].count, 2, @"Regular expressions should work on pooled readers.");
+        
+        query.predicate = [NSPredicate predicateWithFormat:@"stringProperty LIKE[c] 'TEST*'"];
+        XCTAssertEqual([query run].count, 1, @"Like expressions should work on pooled readers.");
+        
+        query.predicate = [NSPredicate predicateWithFormat:@"stringProperty LIKE[c] 'item*'"];
+        query.sortDescriptors = @[ [NSSortDescriptor sortDescriptorWithKey:@"stringProperty" ascending:YES selector:@selector(localizedStandardCompare:)] ];
+        XCTAssertEqualObjects([[query run] valueForKey:@"stringProperty"], (@[ @"item 1", @"Item 2", @"item 10" ]), @"Localized collations should work on pooled readers.");
+        
+        query.sortDescriptors = @[ [NSSortDescriptor sortDescriptorWithKey:@"stringProperty" ascending:NO selector:@selector(localizedCaseInsensitiveCompare:)] ];
+        XCTAssertEqualObjects([[query run] valueForKey:@"stringProperty"], (@[ @"Item 2", @"item 10", @"item 1" ]), @"Case insensitive localized collations should work on pooled readers.");
+    }];
+}
+
+- (void)testConcurrentReadsBeyondPoolSize
+{
+    TNKConnection *fileConnection = [self fileConnection];
+    [TNKConnection useConnection:fileConnection block:^(TNKConnection *connection) {
+        [TNKTestObject insertObjectWithInitialization:^(TNKTestObject *object) {
+            object.stringProperty = @"Testing-123";
+        }];
+        [connection save];
+    }];
+    
+    // the pool has 4 readers
+    NSUInteger count = 16;
+    __block NSUInteger activeReaderCount = 0;
+    __block NSUInteger maximumActiveReaderCount = 0;
+    __block NSUInteger resultCount = 0;
+    NSObject *lock = [NSObject new];
+    
+    dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t index) {
+        [fileConnection performRead:^(FMDatabase *db) {
+            @synchronized(lock) {
+                activeReaderCount++;
+                maximumActiveReaderCount = MAX(maximumActiveReaderCount, activeReaderCount);
+            }
+            
+            FMResultSet *resultSet = [db executeQuery:[NSString stringWithFormat:@"SELECT objectID FROM %@ WHERE stringProperty REGEXP 'Testing-[0-9]+'", [TNKTestObject class]]];
+            while ([resultSet next]) {
+                @synchronized(lock) {
+                    resultCount++;
+                }
+            }
+            [resultSet close];
+            [NSThread sleepForTimeInterval:0.05];
+            
+            @synchronized(lock) {
+                activeReaderCount--;
+            }
+        }];
+    });
+    
+    XCTAssertEqual(resultCount, count, @"Reads beyond the size of the pool should wait for a reader instead of failing.");
+    XCTAssertLessThanOrEqual(maximumActiveReaderCount, 4, @"No more than the pool's readers should be used at once.");
+}
+
+- (void)testSaveDuringTruncatingCheckpoint
+{
+    TNKConnection *fileConnection = [self fileConnection];
+    
+    [TNKConnection useConnection:fileConnection block:^(TNKConnection *connection) {
+        [TNKTestObject insertObjectWithInitialization:nil];
+        [connection save];
+        
+        __block BOOL saved = NO;
+        dispatch_group_t group = dispatch_group_create();
+        dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+        [connection performReadSnapshot:^(TNKConnection *connection) {
+            // a commit after the snapshot started leaves this reader behind, so the checkpoint has to wait for it
+            [TNKTestObject insertObjectWithInitialization:nil];
+            [connection save];
+            
+            dispatch_group_async(group, queue, ^{
+                [connection checkpointAndTruncate:YES];
+            });
+            [NSThread sleepForTimeInterval:0.1];
+            
+            // the checkpoint holds the write lock while it waits
+            dispatch_group_async(group, queue, ^{
+                [TNKConnection useConnection:connection block:^(TNKConnection *connection) {
+                    [TNKTestObject insertObjectWithInitialization:nil];
+                    saved = [connection saveWithDurability:TNKSaveDurabilityFull chunkHandler:nil];
+                }];
+            });
+            [NSThread sleepForTimeInterval:0.1];
+        }];
+        dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+        
+        XCTAssertTrue(saved, @"Saves should wait for a truncating checkpoint instead of failing.");
+        XCTAssertEqual(connection.truncatingCheckpointCount, 1, @"The checkpoint should finish once the reader is done.");
+        XCTAssertEqual(connection.failedCheckpointCount, 0, @"Checkpoints that wait for readers should not fail.");
+    }];
+}
+
+- (void)testNestedBlocksOnObjectsSharingLocks
+{
+    NSUInteger objectCount = 256;
+    NSMutableArray *objects = [[NSMutableArray alloc] initWithCapacity:objectCount];
+    [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+        for (NSUInteger index = 0; index < objectCount; index++) {
+            [objects addObject:[TNKTestObject insertObjectWithInitialization:nil]];
+        }
+    }];
+    
+    // each pair is always nested in the same order, but the objects share striped locks with objects in other pairs
+    dispatch_apply(objectCount * 4, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t index) {
+        NSUInteger pair = index % (objectCount / 2);
+        TNKTestObject *first = objects[pair * 2];
+        TNKTestObject *second = objects[pair * 2 + 1];
+        
+        [first performBlockAndWait:^{
+            [second performBlockAndWait:^{
+                second.intProperty = first.intProperty + 1;
+            }];
+        }];
+    });
+    
+    XCTAssertEqual(_connection.insertedObjects.count, objectCount, @"Nested blocks for objects that share a striped lock should not deadlock.");
+}
+
+- (void)testBlocksAreSerialized
+{
+    __block TNKTestObject *object = nil;
+    [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+        object = [TNKTestObject insertObjectWithInitialization:nil];
+    }];
+    
+    NSUInteger count = 2000;
+    dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t index) {
+        [object performBlockAndWait:^{
+            object.intProperty = object.intProperty + 1;
+        }];
+    });
+    XCTAssertEqual(object.intProperty, (int)count, @"Blocks for the same object should never lose an update.");
+    
+    dispatch_semaphore_t finished = dispatch_semaphore_create(0);
+    for (NSUInteger index = 0; index < count; index++) {
+        [object performBlock:^{
+            object.intProperty = object.intProperty + 1;
+        }];
+    }
+    [object performBlock:^{
+        dispatch_semaphore_signal(finished);
+    }];
+    dispatch_semaphore_wait(finished, DISPATCH_TIME_FOREVER);
+    XCTAssertEqual(object.intProperty, (int)count * 2, @"Asynchronous blocks should run in order, one at a time.");
+}
+
+- (void)testConcurrentInserts
+{
+    NSUInteger count = 1000;
+    
+    dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t index) {
+        [TNKConnection useConnection:_connection block:^(TNKConnection *connection) {
+            [TNKTestObject insertObjectWithInitialization:^(TNKTestObject *object) {
+                object.intProperty = (int)index;
+            }];
+        }];
+    });
+    
+    XCTAssertEqual(_connection.insertedObjects.count, count, @"Objects inserted from multiple threads should all be tracked.");
+}
+
+- (void)testInsertPerformance
+{
+    NSUInteger count = 50000;
+    
+    [self measureMetrics:[self.class defaultPerformanceMetrics] automaticallyStartMeasuring:NO forBlock:^{
+        // a new database for each run, so that the table doesn't grow between runs
+        TNKConnection *connection = [TNKConnection connectionWithURL:nil classes:[NSSet setWithObject:[TNKTestObject class]]];
+        
+        // keep automatic saves from running while the objects are created or measured
+        connection.saveScheduler.maximumPendingChangeCount = NSUIntegerMax;
+        connection.saveScheduler.maximumPendingBytes = NSUIntegerMax;
+        connection.saveScheduler.interval = 3600.0;
+        connection.saveScheduler.maximumInterval = 3600.0;
+        
+        [TNKConnection useConnection:connection block:^(TNKConnection *connection) {
+            for (NSUInteger index = 0; index < count; index++) {
+                [TNKTestObject insertObjectWithInitialization:^(TNKTestObject *object) {
+                    object.stringProperty = @"Testing";
+                    object.intProperty = (int)index;
+                    object.doubleProperty = index / 2.0;
+                }];
+            }
+            
+            [self startMeasuring];
+            [connection save];
+            [self stopMeasuring];
+        }];
+    }];
+}
+
 @end